@@ -5,15 +5,58 @@
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/ASTMatchers/ASTMatchFinder.h"
 #include "clang/ASTMatchers/ASTMatchers.h"
+#include "clang/AST/RecordLayout.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Lex/Lexer.h"
+#include "clang/Lex/MacroInfo.h"
+#include "clang/Lex/PPCallbacks.h"
+#include "clang/Lex/Preprocessor.h"
+#include "clang/Basic/TargetOptions.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/VirtualFileSystem.h"
 
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <linux/limits.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <iomanip>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <numeric>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <random>
+#include <string_view>
+#include <tuple>
+#include <thread>
 
 #define LOG_DIR "/home/jdoh/test/refcount_count/log/"
 #define COMPILE_DATABASE "/home/jdoh/test/refcount_count/compile_commands.json"
@@ -41,23 +84,442 @@ static cl::opt<bool> verbose("verbose",
     cl::cat(refcntCategory)                   // what category this belongs to
 );
 
+enum class Engine { MATCHER, VISITOR, LEXER };
+
+static cl::opt<Engine> engine("engine",
+    cl::desc(R"(Select the AST traversal backend)"),
+    cl::values(
+        clEnumValN(Engine::MATCHER, "matcher", "Generic ASTMatchers (default)"),
+        clEnumValN(Engine::VISITOR, "visitor", "Specialised RecursiveASTVisitor"),
+        clEnumValN(Engine::LEXER, "lexer", "Raw lexer estimate, no parsing and no logs")
+    ),
+    cl::init(Engine::MATCHER),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<bool> lexerCompare("lexer-compare",
+    cl::desc(R"(Also run the lexer estimate and report how far it is from
+the selected engine)"),
+    cl::init(false),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<bool> skipFunctionBodies("skip-function-bodies",
+    cl::desc(R"(Do not parse function bodies. Only struct fields are needed,
+so this saves most of the parse time, but fields of
+structs declared inside functions are not counted)"),
+    cl::init(false),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<bool> macroContext("macro-context",
+    cl::desc(R"(Record expansions of macros that use the tracked types or
+APIs and attribute macro-generated fields to them)"),
+    cl::init(false),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<std::string> gitRange("git-range",
+    cl::desc(R"(Only analyse the translation units affected by the files
+changed in the given git revision range, e.g. HEAD~1..HEAD)"),
+    cl::value_desc("range"),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<std::string> includeIndex("include-index",
+    cl::desc(R"(Reverse include index used by --git-range to find the
+translation units including a changed header, as written
+by --write-include-index)"),
+    cl::value_desc("file"),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<std::string> writeIncludeIndex("write-include-index",
+    cl::desc(R"(Record the headers each analysed translation unit includes
+and write them to a reverse include index. Entries for
+translation units not analysed in this run are kept)"),
+    cl::value_desc("file"),
+    cl::cat(refcntCategory)
+);
+
+static cl::list<std::string> compileDbs("compile-db",
+    cl::desc(R"(Analyse the translation units of several compilation
+databases, e.g. one per kernel config, given as [name=]path.
+TUs that preprocess identically are analysed only once,
+and totals are reported per database)"),
+    cl::value_desc("[name=]file"),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<std::string> shard("shard",
+    cl::desc(R"(Analyse only shard i of N (0 <= i < N) of the translation
+units, balanced by estimated cost. Shards write no logs,
+only the --result-store that `refcnt merge` combines into
+the output of a --jobs=1 run)"),
+    cl::value_desc("i/N"),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<std::string> resultStore("result-store",
+    cl::desc(R"(Write the matches of every file reached to a result store,
+which `refcnt merge` and `refcnt diff` read)"),
+    cl::value_desc("file"),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<double> sampleFraction("sample",
+    cl::desc(R"(Analyse only about this fraction of the translation units
+of every top-level directory and estimate the totals of the
+whole tree, with 95% confidence intervals)"),
+    cl::value_desc("fraction"),
+    cl::init(0),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<unsigned> sampleSeed("sample-seed",
+    cl::desc(R"(Random seed for --sample (default: 0))"),
+    cl::init(0),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<unsigned> jobs("jobs",
+    cl::desc(R"(Number of translation units to analyse in parallel
+(default: 1, 0 for all cores))"),
+    cl::init(1),
+    cl::cat(refcntCategory)
+);
+
+static cl::alias jobsShort("j",
+    cl::desc("Alias for --jobs"),
+    cl::aliasopt(jobs),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<bool> fileCache("file-cache",
+    cl::desc(R"(Share stat results and header contents between all
+translation units (default: on))"),
+    cl::init(true),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<unsigned> fileCacheLimit("file-cache-limit",
+    cl::desc(R"(Stop caching header contents once the cache holds <MB>
+megabytes (default: 1024))"),
+    cl::value_desc("MB"),
+    cl::init(1024),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<std::string> layoutReport("layout-report",
+    cl::desc(R"(Write the layout of every struct with tracked fields: their
+offsets and cache lines, the fields sharing those lines
+and the padding holes)"),
+    cl::value_desc("file"),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<unsigned> cacheLineSize("cache-line-size",
+    cl::desc(R"(Cache line size in bytes for --layout-report (default: 64))"),
+    cl::init(64),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<std::string> typeConfig("type-config",
+    cl::desc(R"(Load the tracked types and APIs from <file>)"),
+    cl::value_desc("file"),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<unsigned> errorBudget("error-budget",
+    cl::desc(R"(Stop parsing a translation unit once it has <n> errors,
+count the fields parsed so far and report it as stopped
+(default: 20, 0 = never stop))"),
+    cl::value_desc("n"),
+    cl::init(20),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<unsigned> progressInterval("progress",
+    cl::desc(R"(Report TUs done, throughput, the slowest TUs being parsed
+and an ETA every <seconds> (default: 0, off))"),
+    cl::value_desc("seconds"),
+    cl::init(0),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<std::string> statusFile("status-file",
+    cl::desc(R"(Write the --progress report to <file> instead of stderr)"),
+    cl::value_desc("file"),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<bool> perfCounters("perf-counters",
+    cl::desc(R"(Count cycles, instructions, LLC misses and branch misses
+of the parse, match and output phases of every TU with
+perf_event_open and print them per phase)"),
+    cl::init(false),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<bool> printStats("stats",
+    cl::desc(R"(Print match and allocation statistics to stderr)"),
+    cl::init(false),
+    cl::cat(refcntCategory)
+);
+
 // ----------------------------------------------------------------------------
 // DEFAULT WARNING SUPPRESSION
 // ----------------------------------------------------------------------------
 
+// Errors of the translation unit being parsed on this thread. Reset by
+// RefcntFrontEndAction for every TU.
+struct TUErrors {
+    unsigned count = 0;
+    std::string first;
+};
+
+static thread_local TUErrors tu_errors;
+
+// Translation units that had errors, with the first error of each.
+class BrokenTUs {
+    public:
+    void add(StringRef file, const TUErrors &errors, bool aborted) {
+        std::lock_guard<std::mutex> guard(lock);
+        tus.push_back({file.str(), errors.first, errors.count, aborted});
+    }
+
+    // Prints the stopped ones, whose fields are only partly counted, and at
+    // most `limit` of the others, in path order.
+    void print(raw_ostream &os, size_t limit) {
+        if (tus.empty()) {
+            return;
+        }
+        std::sort(tus.begin(), tus.end(), [](const Entry &a, const Entry &b) {
+            return std::tie(b.aborted, a.file) < std::tie(a.aborted, b.file);
+        });
+        const size_t aborted = std::count_if(tus.begin(), tus.end(),
+                                             [](const Entry &e) { return e.aborted; });
+        os << tus.size() << " translation units with errors, "
+           << aborted << " stopped early:\n";
+        if (aborted != 0) {
+            os << "  (fields and includes after the stop are not counted,"
+               << " see --error-budget)\n";
+        }
+        limit += aborted;
+        for (size_t i = 0; i < tus.size() && i < limit; ++i) {
+            os << "  " << tus[i].file << " (" << tus[i].errors << " errors"
+               << (tus[i].aborted ? ", stopped" : "") << "): " << tus[i].first << "\n";
+        }
+        if (tus.size() > limit) {
+            os << "  ... and " << tus.size() - limit << " more\n";
+        }
+    }
+
+    private:
+    struct Entry {
+        std::string file;
+        std::string first;
+        unsigned errors;
+        bool aborted;
+    };
+    std::mutex lock;
+    std::vector<Entry> tus;
+};
+
+static BrokenTUs broken_tus;
+
 // The WarningDiagConsumer allows us to suppress warning and error messages
 // which are raised when a file is being parsed by clang. This allows us to
 // turn off extraneous output since we assume that we are checking code 
-// which already compiles.
+// which already compiles. Warnings are not even generated (see
+// addDiagnosticAdjusters); errors are counted and only the first one of a
+// TU is formatted.
 class WarningDiagConsumer : public DiagnosticConsumer {
 
     public:
     virtual void HandleDiagnostic(
             DiagnosticsEngine::Level Level, const Diagnostic& Info) override {
-        // simply do nothing
+        if (Level < DiagnosticsEngine::Error) {
+            return;
+        }
+        if (tu_errors.count++ != 0) {
+            return;
+        }
+        SmallString<128> message;
+        if (Info.hasSourceManager() && Info.getLocation().isValid()) {
+            const PresumedLoc loc = Info.getSourceManager().getPresumedLoc(Info.getLocation());
+            if (loc.isValid()) {
+                message += loc.getFilename();
+                message += ':';
+                message += std::to_string(loc.getLine());
+                message += ": ";
+            }
+        }
+        Info.FormatDiagnostic(message);
+        tu_errors.first = message.str().str();
+    }
+};
+
+// Ignores all warnings in the compiler itself, so they are never built, and
+// makes clang stop reporting errors at the error budget.
+void addDiagnosticAdjusters(ClangTool &Tool)
+{
+    Tool.appendArgumentsAdjuster(getInsertArgumentAdjuster(
+        {"-w", "-ferror-limit=" + std::to_string(errorBudget)},
+        ArgumentInsertPosition::END));
+}
+
+// ----------------------------------------------------------------------------
+// TRACKED TYPE REGISTRY
+// ----------------------------------------------------------------------------
+
+// A refcount type we count fields of. Typedefs are matched by the name of
+// the typedef and records by the name of the struct; `spelling` is how the
+// field type prints and `label` is what the counters are reported as.
+struct TrackedType {
+    enum Kind { TYPEDEF, RECORD } kind;
+    std::string name;
+    std::string spelling;
+    std::string label;
+};
+
+// The registry drives everything that depends on the set of tracked types:
+// the field matcher, the classifier in TypeCheck and the layout of the Refcnt
+// counters. It starts out with the built-in kernel types and can be replaced
+// with --type-config. The config file has one entry per line:
+//
+//      typedef <name> [label]      e.g. typedef atomic_t
+//      record <name> [label]       e.g. record kref
+//      exclude <record name>       fields inside this record are not counted
+//      api <function name>         e.g. api kref_get
+//
+// Empty lines and lines starting with '#' are ignored.
+class TypeRegistry {
+    public:
+    std::vector<TrackedType> types;
+    std::vector<std::string> excluded;
+    std::vector<std::string> apis;
+
+    TypeRegistry() {
+        loadDefaults();
+    }
+
+    void loadDefaults() {
+        clear();
+        for (const char *name : { "atomic_t", "atomic_long_t", "atomic64_t", "refcount_t" }) {
+            addType(TrackedType::TYPEDEF, name, name);
+        }
+        addType(TrackedType::RECORD, "kref", "kref");
+        excluded = { "kref", "refcount_t" };
+
+        for (const char *prefix : { "atomic_", "atomic_long_", "atomic64_", "refcount_" }) {
+            for (const char *op : { "set", "add", "sub", "inc", "dec" }) {
+                addApi(std::string(prefix) + op);
+            }
+        }
+        for (const char *name : { "kref_init", "kref_get", "kref_put" }) {
+            addApi(name);
+        }
+    }
+
+    // Replaces the registry with the contents of the given config file.
+    // Returns false and sets err if the file cannot be read or parsed.
+    bool loadFromFile(StringRef path, std::string &err) {
+        auto buffer = llvm::MemoryBuffer::getFile(path);
+        if (!buffer) {
+            err = "cannot read '" + path.str() + "': " + buffer.getError().message();
+            return false;
+        }
+
+        clear();
+        SmallVector<StringRef, 4> tokens;
+        unsigned lineNo = 0;
+
+        for (llvm::line_iterator it(**buffer, /*SkipBlanks=*/true, '#'); !it.is_at_eof(); ++it) {
+            lineNo = it.line_number();
+            tokens.clear();
+            llvm::SplitString(*it, tokens);
+            if (tokens.empty()) {
+                continue;
+            }
+
+            const StringRef kind = tokens[0];
+            if ((kind == "typedef" || kind == "record") && (tokens.size() == 2 || tokens.size() == 3)) {
+                addType(kind == "typedef" ? TrackedType::TYPEDEF : TrackedType::RECORD,
+                        tokens[1], tokens.size() == 3 ? tokens[2] : tokens[1]);
+            }
+            else if (kind == "exclude" && tokens.size() == 2) {
+                excluded.push_back(tokens[1].str());
+            }
+            else if (kind == "api" && tokens.size() == 2) {
+                addApi(tokens[1]);
+            }
+            else {
+                err = path.str() + ":" + std::to_string(lineNo) + ": malformed entry '" + it->str() + "'";
+                return false;
+            }
+        }
+
+        if (types.empty()) {
+            err = path.str() + ": no tracked types";
+            return false;
+        }
+        return true;
+    }
+
+    // Returns the index of the tracked type printed as `spelling`, or -1.
+    int classify(StringRef spelling) const {
+        auto it = bySpelling.find(spelling);
+        return it == bySpelling.end() ? -1 : static_cast<int>(it->second);
+    }
+
+    bool isApi(StringRef name) const {
+        return apiSet.contains(name);
+    }
+
+    std::vector<StringRef> names(TrackedType::Kind kind) const {
+        std::vector<StringRef> ret;
+        for (const auto &type : types) {
+            if (type.kind == kind) {
+                ret.push_back(type.name);
+            }
+        }
+        return ret;
+    }
+
+    std::vector<StringRef> excludedNames() const {
+        return std::vector<StringRef>(excluded.begin(), excluded.end());
+    }
+
+    private:
+    llvm::StringMap<unsigned> bySpelling;
+    llvm::StringSet<> apiSet;
+
+    void clear() {
+        types.clear();
+        excluded.clear();
+        apis.clear();
+        bySpelling.clear();
+        apiSet.clear();
+    }
+
+    void addType(TrackedType::Kind kind, StringRef name, StringRef label) {
+        std::string spelling = (kind == TrackedType::RECORD ? "struct " : "") + name.str();
+        if (!bySpelling.try_emplace(spelling, types.size()).second) {
+            return;
+        }
+        types.push_back({ kind, name.str(), spelling, label.str() });
+    }
+
+    void addApi(StringRef name) {
+        if (apiSet.insert(name).second) {
+            apis.push_back(name.str());
+        }
     }
 };
 
+static TypeRegistry registry;
+
 // ----------------------------------------------------------------------------
 // CALLBACK CLASSES
 // ----------------------------------------------------------------------------
@@ -66,252 +528,3406 @@ class WarningDiagConsumer : public DiagnosticConsumer {
 // doing the actual code analysis
 //
 // ...
+// One counter per tracked type, indexed like TypeRegistry::types.
 class Refcnt {
     public:
-    int atomic_t_cnt;
-    int atomic_long_t_cnt;
-    int atomic64_t_cnt;
-    int refcount_t_cnt;
-    int kref_cnt;
-    
+    std::vector<int> cnt;
+
     Refcnt()
-    : atomic_t_cnt(0), atomic_long_t_cnt(0), atomic64_t_cnt(0),
-        refcount_t_cnt(0), kref_cnt(0)
+    : cnt(registry.types.size(), 0)
     {}
 
     Refcnt &operator+=(const Refcnt &refcnt) {
-        atomic_t_cnt += refcnt.atomic_t_cnt;
-        atomic_long_t_cnt += refcnt.atomic_long_t_cnt;
-        atomic64_t_cnt += refcnt.atomic64_t_cnt;
-        refcount_t_cnt += refcnt.refcount_t_cnt;
-        kref_cnt += refcnt.kref_cnt;
+        if (cnt.size() < refcnt.cnt.size()) {
+            cnt.resize(refcnt.cnt.size(), 0);
+        }
+        for (size_t i = 0; i < refcnt.cnt.size(); ++i) {
+            cnt[i] += refcnt.cnt[i];
+        }
         return *this;
     }
+
+    int get(size_t type) const {
+        return type < cnt.size() ? cnt[type] : 0;
+    }
+
+    // Prints one "label: count" line per tracked type. Works for both
+    // std::ostream and llvm::raw_ostream.
+    template <typename OStream>
+    void print(OStream &os) const {
+        for (size_t i = 0; i < registry.types.size(); ++i) {
+            os << registry.types[i].label << ": " << get(i) << "\n";
+        }
+    }
 };
 
 static std::ofstream total_output;
-static Refcnt total_refcnt;
+static thread_local Refcnt total_refcnt;
+
+// Heap allocations made by this thread through operator new, reported with
+// --stats. Only builds configured with -DREFCNT_COUNT_ALLOCS=ON replace
+// operator new; the others keep the standard one and do not count.
+static thread_local uint64_t heap_allocs = 0;
+
+#ifdef REFCNT_COUNT_ALLOCS
+// libstdc++ implements the array and nothrow forms on top of this one, and
+// its operator delete frees with free().
+void *operator new(size_t size) {
+    ++heap_allocs;
+    while (true) {
+        if (void *mem = malloc(size != 0 ? size : 1)) {
+            return mem;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+#endif
+
+// Phases of a TU measured with --perf-counters, and the counters read.
+enum PerfPhase { PERF_PHASE_PARSE, PERF_PHASE_MATCH, PERF_PHASE_OUTPUT, NUM_PERF_PHASES,
+                 PERF_PHASE_NONE = NUM_PERF_PHASES };
+enum PerfCounter { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_LLC_MISSES, PERF_BRANCH_MISSES,
+                   NUM_PERF_COUNTERS };
+
+// Allocation statistics, printed at the end of the run with --stats.
+struct MatchStats {
+    uint64_t matches = 0;
+    uint64_t heapAllocs = 0;
+    uint64_t arenaBytes = 0;
+    double traversalSeconds = 0;
+    double tuSeconds = 0;
+    uint64_t macroMatches = 0;
+    uint64_t typeMacroExpansions = 0;
+    uint64_t apiMacroExpansions = 0;
+    uint64_t perf[NUM_PERF_PHASES][NUM_PERF_COUNTERS] = {};
+    uint64_t perfReadings = 0;
+    uint64_t perfScaledReadings = 0;    // the counters were multiplexed
+
+    MatchStats &operator+=(const MatchStats &other) {
+        matches += other.matches;
+        heapAllocs += other.heapAllocs;
+        arenaBytes += other.arenaBytes;
+        traversalSeconds += other.traversalSeconds;
+        tuSeconds += other.tuSeconds;
+        macroMatches += other.macroMatches;
+        typeMacroExpansions += other.typeMacroExpansions;
+        apiMacroExpansions += other.apiMacroExpansions;
+        for (unsigned p = 0; p < NUM_PERF_PHASES; ++p) {
+            for (unsigned c = 0; c < NUM_PERF_COUNTERS; ++c) {
+                perf[p][c] += other.perf[p][c];
+            }
+        }
+        perfReadings += other.perfReadings;
+        perfScaledReadings += other.perfScaledReadings;
+        return *this;
+    }
+};
+
+static thread_local MatchStats match_stats;
+
+// Counts rolled up by directory and by enclosing struct, so questions like
+// "how many atomic_t refcounts are in drivers/net" or "which structs have
+// several refcount fields" do not need the per-file logs.
+class Aggregates {
+    public:
+    // Adds the counts of the fields declared in srcFile.
+    void addFile(StringRef srcFile, const Refcnt &counts) {
+        dirs[llvm::sys::path::parent_path(srcFile)] += counts;
+    }
+
+    // Adds a field of tracked type `type` declared in the top-level struct
+    // `owner` of srcFile.
+    void addField(StringRef srcFile, StringRef owner, int type) {
+        SmallString<256> key(owner);
+        key += '\t';
+        key += srcFile;
+        Refcnt &counts = structs[key];
+        if (counts.cnt.size() <= (size_t)type) {
+            counts.cnt.resize(type + 1, 0);
+        }
+        ++counts.cnt[type];
+    }
+
+    void merge(const Aggregates &other) {
+        for (const auto &entry : other.dirs) {
+            dirs[entry.getKey()] += entry.second;
+        }
+        for (const auto &entry : other.structs) {
+            structs[entry.getKey()] += entry.second;
+        }
+    }
+
+    // Writes one line per directory with the totals of its whole subtree,
+    // sorted by path, so any subsystem total is a single line lookup.
+    bool writeDirectories(StringRef path, std::string &err) const {
+        llvm::StringMap<Refcnt> subtree;
+        for (const auto &entry : dirs) {
+            StringRef dir = entry.getKey();
+            while (!dir.empty()) {
+                subtree[dir] += entry.second;
+                const StringRef parent = llvm::sys::path::parent_path(dir);
+                if (parent == dir) {
+                    break;
+                }
+                dir = parent;
+            }
+        }
+
+        std::vector<const StringMapEntry<Refcnt> *> sorted;
+        for (const auto &entry : subtree) {
+            sorted.push_back(&entry);
+        }
+        std::sort(sorted.begin(), sorted.end(), [](const auto *a, const auto *b) {
+            return a->getKey() < b->getKey();
+        });
+
+        std::error_code EC;
+        raw_fd_ostream os(path, EC, llvm::sys::fs::OF_Text);
+        if (EC) {
+            err = "cannot write '" + path.str() + "': " + EC.message();
+            return false;
+        }
+        os << "# directory";
+        printLabels(os);
+        for (const auto *entry : sorted) {
+            os << entry->getKey();
+            printCounts(os, entry->second);
+        }
+        return true;
+    }
+
+    // Writes one line per top-level struct, those with the most tracked
+    // fields first.
+    bool writeStructs(StringRef path, std::string &err) const {
+        std::vector<std::pair<int, const StringMapEntry<Refcnt> *>> sorted;
+        for (const auto &entry : structs) {
+            sorted.emplace_back(total(entry.second), &entry);
+        }
+        std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+            if (a.first != b.first) {
+                return a.first > b.first;
+            }
+            return a.second->getKey() < b.second->getKey();
+        });
+
+        std::error_code EC;
+        raw_fd_ostream os(path, EC, llvm::sys::fs::OF_Text);
+        if (EC) {
+            err = "cannot write '" + path.str() + "': " + EC.message();
+            return false;
+        }
+        os << "# struct\tfile";
+        printLabels(os);
+        for (const auto &entry : sorted) {
+            os << entry.second->getKey();
+            printCounts(os, entry.second->second);
+        }
+        return true;
+    }
+
+    private:
+    static int total(const Refcnt &counts) {
+        int ret = 0;
+        for (int n : counts.cnt) {
+            ret += n;
+        }
+        return ret;
+    }
+
+    static void printLabels(raw_ostream &os) {
+        for (const auto &type : registry.types) {
+            os << '\t' << type.label;
+        }
+        os << "\ttotal\n";
+    }
+
+    static void printCounts(raw_ostream &os, const Refcnt &counts) {
+        for (size_t i = 0; i < registry.types.size(); ++i) {
+            os << '\t' << counts.get(i);
+        }
+        os << '\t' << total(counts) << '\n';
+    }
+
+    llvm::StringMap<Refcnt> dirs;       // directory -> fields declared directly in it
+    llvm::StringMap<Refcnt> structs;    // "struct\tfile" -> fields of that struct
+};
+
+static thread_local Aggregates aggregates;
+
+// Set while analysing a TU shared by several --compile-db configs. Receives
+// the counts of every file the TU reaches, whether or not it logs them,
+// so each config can be totalled with its own header dedup.
+static thread_local llvm::StringMap<Refcnt> *tu_file_counts = nullptr;
+
+// Set while analysing a TU of a --sample run. Receives the counts of the
+// fields in the TU's own source file, whether or not the TU logs it.
+static thread_local Refcnt *tu_main_counts = nullptr;
+
+// Everything above that is thread_local belongs to one worker thread, so the
+// matching path never takes a lock. Each worker merges its share into
+// run_totals once, when it is done.
+struct RunTotals {
+    std::mutex mutex;
+    Refcnt refcnt;
+    MatchStats stats;
+    Aggregates aggregates;
+};
+
+static RunTotals run_totals;
+
+void mergeThreadTotals()
+{
+    std::lock_guard<std::mutex> lock(run_totals.mutex);
+    run_totals.refcnt += total_refcnt;
+    run_totals.stats += match_stats;
+    run_totals.aggregates.merge(aggregates);
+    total_refcnt = Refcnt();
+    match_stats = MatchStats();
+    aggregates = Aggregates();
+}
+
+// Log files claimed by a translation unit of this run. A source file is
+// logged by the first TU that reaches it; a log that already exists on disk
+// was written by an earlier run. Shared by all worker threads.
+class LogClaims {
+    public:
+    // Returns true if the caller should write logFile. A --git-range run
+    // counts the affected files whatever logs a full run left behind.
+    bool claim(StringRef logFile) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!claimed.insert(logFile).second) {
+            return false;
+        }
+        return !gitRange.empty() || access(logFile.str().c_str(), F_OK) != 0;
+    }
 
-class TypeCheck : public MatchFinder::MatchCallback {
     private:
-    std::map<std::string, std::pair<std::stringstream, Refcnt>> files;
+    std::mutex mutex;
+    llvm::StringSet<> claimed;
+};
+
+static LogClaims log_claims;
+
+// Returns the outermost record a field is declared in.
+const RecordDecl *getTopLevelStruct(const FieldDecl *field) {
+    const DeclContext *tmp = dyn_cast<DeclContext>(field->getParent());
+    const RecordDecl *parent = nullptr;
+
+    while (dyn_cast<RecordDecl>(tmp)) {
+        parent = dyn_cast<RecordDecl>(tmp);
+        tmp = parent->getParent();
+    }
+
+    return parent;
+}
+
+// A single matched declaration. The strings point into the per-TU arena of
+// the TypeCheck that produced it, and nothing is formatted until the log
+// files are written at the end of the translation unit.
+struct MatchRecord {
+    unsigned file;      // index into TypeCheck::logFiles
+    unsigned line;
+    unsigned col;
+    StringRef name;
+    StringRef type;
+    StringRef macro;    // tracked macro the declaration comes from, if any
+    StringRef owner;    // top-level struct of a field, if any
+    int tracked;        // index into TypeRegistry::types, -1 if none
+};
+
+// Macro expansions that produce tracked types or API calls in the current
+// translation unit, filled in by RefcntPPCallbacks while the file is being
+// preprocessed. Matches located in a macro are attributed to the outermost
+// tracked macro expanded at their expansion location.
+struct MacroContext {
+    llvm::DenseMap<SourceLocation::UIntTy, StringRef> expansions;
+    uint64_t typeExpansions = 0;
+    uint64_t apiExpansions = 0;
+
+    StringRef lookup(const SourceManager &SM, SourceLocation loc) const {
+        if (!loc.isMacroID()) {
+            return StringRef();
+        }
+        return expansions.lookup(SM.getExpansionLoc(loc).getRawEncoding());
+    }
+};
 
+// A macro is tracked if its own name is a tracked API or type name, or if
+// its replacement list mentions one, e.g. `#define DECLARE_REF(n) atomic_t n`.
+// Deciding this once per #define keeps MacroExpands down to a set lookup.
+class RefcntPPCallbacks : public PPCallbacks {
     public:
-    virtual void onStartOfTranslationUnit() override {
-        
+    RefcntPPCallbacks(const SourceManager &SM, std::shared_ptr<MacroContext> context)
+    : SM(SM), context(std::move(context)) {
+        for (const auto &type : registry.types) {
+            typeNames.insert(type.name);
+        }
+        for (const auto &api : registry.apis) {
+            apiNames.insert(api);
+        }
     }
 
-    virtual void onEndOfTranslationUnit() override {
-        std::string logFileDir;
-        std::ofstream ofs;
+    virtual void MacroDefined(const Token &MacroNameTok, const MacroDirective *MD) override {
+        const MacroInfo *MI = MD->getMacroInfo();
+        if (MI == nullptr) {
+            return;
+        }
+
+        Kind kind = classify(MacroNameTok.getIdentifierInfo());
+        for (const Token &tok : MI->tokens()) {
+            if (kind != NONE) {
+                break;
+            }
+            kind = classify(tok.getIdentifierInfo());
+        }
+        if (kind != NONE) {
+            tracked[MI] = kind;
+        }
+    }
+
+    virtual void MacroExpands(const Token &MacroNameTok, const MacroDefinition &MD,
+            SourceRange Range, const MacroArgs *Args) override {
+        auto it = tracked.find(MD.getMacroInfo());
+        if (it == tracked.end()) {
+            return;
+        }
+
+        if (it->second == TYPE) {
+            ++context->typeExpansions;
+        }
+        else {
+            ++context->apiExpansions;
+        }
+
+        // Nested expansions share the expansion location of the outermost
+        // macro, which is reported first and therefore wins.
+        context->expansions.try_emplace(
+            SM.getExpansionLoc(Range.getBegin()).getRawEncoding(),
+            MacroNameTok.getIdentifierInfo()->getName());
+    }
+
+    private:
+    enum Kind { NONE, TYPE, API };
 
-        for (auto &elem : files) {
-            logFileDir = elem.first.substr(0, elem.first.rfind('/'));
-            if (access(logFileDir.c_str(), F_OK) != 0) {
-                system(("mkdir -p " + logFileDir).c_str());
+    const SourceManager &SM;
+    std::shared_ptr<MacroContext> context;
+    llvm::StringSet<> typeNames, apiNames;
+    llvm::DenseMap<const IdentifierInfo *, Kind> identifiers;
+    llvm::DenseMap<const MacroInfo *, Kind> tracked;
+
+    Kind classify(const IdentifierInfo *II) {
+        if (II == nullptr) {
+            return NONE;
+        }
+
+        auto inserted = identifiers.try_emplace(II, NONE);
+        if (inserted.second) {
+            const StringRef name = II->getName();
+            if (typeNames.contains(name)) {
+                inserted.first->second = TYPE;
             }
-            
-            ofs.open(elem.first);
-            if (!ofs.is_open()) {
-                llvm::errs() << "Log file " << elem.first << " open failed!\n";
-                exit(1);
+            else if (apiNames.contains(name)) {
+                inserted.first->second = API;
             }
-            ofs << elem.second.first.str();
-            ofs << "atomic_t: " << elem.second.second.atomic_t_cnt << "\n"
-                << "atomic_long_t: " << elem.second.second.atomic_long_t_cnt << "\n"
-                << "atomic64_t: " << elem.second.second.atomic64_t_cnt << "\n"
-                << "refcount_t: " << elem.second.second.refcount_t_cnt << "\n"
-                << "kref: " << elem.second.second.kref_cnt << "\n";
-            ofs.close();
-            total_refcnt += elem.second.second;
         }
+        return inserted.first->second;
+    }
+};
+
+// Writes the log of one source file: a line per match, then its counts.
+void writeLog(StringRef logFile, ArrayRef<MatchRecord> records, const Refcnt &refcnt)
+{
+    // A --git-range run sees part of the tree and must not replace the
+    // logs of a full run
+    if (!gitRange.empty()) {
+        return;
+    }
+    const std::string logFileDir = logFile.substr(0, logFile.rfind('/')).str();
+    if (access(logFileDir.c_str(), F_OK) != 0) {
+        system(("mkdir -p " + logFileDir).c_str());
     }
 
-    virtual void run(const MatchFinder::MatchResult& Result) override {
-        const clang::DeclaratorDecl *node = Result.Nodes.getNodeAs<clang::DeclaratorDecl>("refcntType");
+    std::ofstream ofs(logFile.str());
+    if (!ofs.is_open()) {
+        llvm::errs() << "Log file " << logFile << " open failed!\n";
+        exit(1);
+    }
+    char rowcol[32];
+    for (const MatchRecord &rec : records) {
+        snprintf(rowcol, sizeof(rowcol), "%u:%u", rec.line, rec.col);
+        ofs << std::left << std::setw(10) << rowcol
+            << "Name: " << std::setw(20) << std::string_view(rec.name)
+            << "Type: " << std::string_view(rec.type);
+        if (!rec.macro.empty()) {
+            ofs << " Macro: " << std::string_view(rec.macro);
+        }
+        ofs << "\n";
+    }
+    refcnt.print(ofs);
+}
+
+// Adds a logged source file to the totals and aggregates of this thread.
+void addFileTotals(StringRef srcFile, ArrayRef<MatchRecord> records, const Refcnt &refcnt)
+{
+    for (const MatchRecord &rec : records) {
+        if (rec.tracked >= 0 && !rec.owner.empty()) {
+            aggregates.addField(srcFile, rec.owner, rec.tracked);
+        }
+    }
+    total_refcnt += refcnt;
+    aggregates.addFile(srcFile, refcnt);
+}
+
+// ----------------------------------------------------------------------------
+// RESULT STORE
+// ----------------------------------------------------------------------------
+
+// The matches of every source file reached by the analysed TUs, kept from
+// the TU with the lowest ordinal (position in the compile database) that has
+// matches in the file. That is the TU which logs the file in a --jobs=1
+// run, so a store can be turned back into exactly the logs and totals of
+// one, whether it comes from a single run or from merging shards. A run with
+// more threads logs a header through whichever TU including it finishes
+// first, so its logs and totals may differ from the store's, and from one
+// run to the next when the TUs see the header differently.
+//
+// On disk a store is text, one line per entry, fields separated by tabs:
+//
+//      refcnt-store 2
+//      F <ordinal> <source file>
+//      R <file> <seq> <line> <col> <type label or -> <name> <type> <struct> <macro>
+//
+// The F lines come first, sorted by path, and a record refers to its file by
+// the index of its F line. Records are sorted by (struct, name, type label
+// or type, file) so that `refcnt diff` can merge two stores a line at a
+// time; <seq> is the position of the record in its file's match order.
+class ResultStore {
+    public:
+    // Offers the matches of translation unit `ordinal` in srcFile.
+    void add(unsigned ordinal, StringRef srcFile, ArrayRef<MatchRecord> records) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto inserted = files.try_emplace(srcFile.str());
+        StoredFile &file = inserted.first->second;
+        if (!inserted.second && file.ordinal <= ordinal) {
+            return;
+        }
+        file.ordinal = ordinal;
+        file.records.clear();
+        for (const MatchRecord &rec : records) {
+            file.records.push_back({0, rec.line, rec.col, strings.save(rec.name),
+                                    strings.save(rec.type), strings.save(rec.macro),
+                                    strings.save(rec.owner), rec.tracked});
+        }
+    }
+
+    bool write(StringRef path, std::string &err) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::error_code EC;
+        raw_fd_ostream os(path, EC, llvm::sys::fs::OF_Text);
+        if (EC) {
+            err = "cannot write '" + path.str() + "': " + EC.message();
+            return false;
+        }
+        os << "refcnt-store 2\n";
+        struct Entry {
+            unsigned file;
+            unsigned seq;
+            const MatchRecord *rec;
+        };
+        std::vector<Entry> entries;
+        unsigned file = 0;
+        for (const auto &entry : files) {
+            os << "F\t" << entry.second.ordinal << '\t' << entry.first << '\n';
+            for (size_t i = 0; i < entry.second.records.size(); ++i) {
+                entries.push_back({file, static_cast<unsigned>(i), &entry.second.records[i]});
+            }
+            ++file;
+        }
+        // Files are numbered in path order, so comparing indexes compares paths
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+            return std::make_tuple(a.rec->owner, a.rec->name, getTypeColumn(*a.rec), a.file, a.seq)
+                 < std::make_tuple(b.rec->owner, b.rec->name, getTypeColumn(*b.rec), b.file, b.seq);
+        });
+        for (const Entry &entry : entries) {
+            const MatchRecord &rec = *entry.rec;
+            os << "R\t" << entry.file << '\t' << entry.seq
+               << '\t' << rec.line << '\t' << rec.col << '\t'
+               << (rec.tracked >= 0 ? StringRef(registry.types[rec.tracked].label) : "-")
+               << '\t' << rec.name << '\t' << rec.type
+               << '\t' << rec.owner << '\t' << rec.macro << '\n';
+        }
+        return true;
+    }
+
+    // Adds the entries of the store at `path`.
+    bool read(StringRef path, std::string &err) {
+        auto buffer = llvm::MemoryBuffer::getFile(path);
+        if (!buffer) {
+            err = "cannot read '" + path.str() + "': " + buffer.getError().message();
+            return false;
+        }
+
+        llvm::StringMap<int> labels;
+        for (size_t i = 0; i < registry.types.size(); ++i) {
+            labels[registry.types[i].label] = i;
+        }
+
+        llvm::line_iterator it(**buffer, /*SkipBlanks=*/true);
+        if (it.is_at_eof() || *it != "refcnt-store 2") {
+            err = "'" + path.str() + "' is not a result store";
+            return false;
+        }
+
+        struct File {
+            unsigned ordinal;
+            StringRef path;
+            std::vector<MatchRecord> records;   // `file` holds the seq
+        };
+        std::vector<File> table;
+
+        SmallVector<StringRef, 10> fields;
+        for (++it; !it.is_at_eof(); ++it) {
+            fields.clear();
+            it->split(fields, '\t');
+            unsigned ordinal = 0;
+            if (fields[0] == "F" && fields.size() == 3 && !fields[1].getAsInteger(10, ordinal)) {
+                table.push_back({ordinal, fields[2], {}});
+                continue;
+            }
+
+            MatchRecord rec = {};
+            unsigned file = 0;
+            if (fields[0] != "R" || fields.size() != 10 ||
+                    fields[1].getAsInteger(10, file) || file >= table.size() ||
+                    fields[2].getAsInteger(10, rec.file) ||
+                    fields[3].getAsInteger(10, rec.line) || fields[4].getAsInteger(10, rec.col)) {
+                err = path.str() + ":" + std::to_string(it.line_number()) + ": malformed entry";
+                return false;
+            }
+            auto label = labels.find(fields[5]);
+            rec.tracked = label == labels.end() ? -1 : label->second;
+            rec.name = fields[6];
+            rec.type = fields[7];
+            rec.owner = fields[8];
+            rec.macro = fields[9];
+            table[file].records.push_back(rec);
+        }
+
+        for (File &file : table) {
+            std::sort(file.records.begin(), file.records.end(),
+                      [](const MatchRecord &a, const MatchRecord &b) { return a.file < b.file; });
+            add(file.ordinal, file.path, file.records);
+        }
+        return true;
+    }
+
+    // Writes the log of every stored file and adds it to the totals, like
+    // the TU owning the file would have in a sequential run.
+    void emit() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &entry : files) {
+            SmallString<PATH_MAX> logFile(LOG_DIR);
+            logFile += entry.first;
+            if (!log_claims.claim(logFile)) {
+                continue;
+            }
+
+            Refcnt refcnt;
+            for (const MatchRecord &rec : entry.second.records) {
+                if (rec.tracked >= 0) {
+                    ++refcnt.cnt[rec.tracked];
+                }
+            }
+            writeLog(logFile, entry.second.records, refcnt);
+            addFileTotals(entry.first, entry.second.records, refcnt);
+        }
+        mergeThreadTotals();
+    }
+
+    private:
+    struct StoredFile {
+        unsigned ordinal = 0;
+        std::vector<MatchRecord> records;
+    };
+
+    // The type label of a tracked record, or its type as written
+    static StringRef getTypeColumn(const MatchRecord &rec) {
+        return rec.tracked >= 0 ? StringRef(registry.types[rec.tracked].label) : rec.type;
+    }
+
+    std::mutex mutex;
+    llvm::BumpPtrAllocator arena;
+    llvm::UniqueStringSaver strings{arena};
+    std::map<std::string, StoredFile> files;
+};
+
+static ResultStore result_store;
+
+// Ordinal of the TU being analysed on this thread, for the result store.
+static thread_local unsigned tu_ordinal = 0;
+
+// Reads the fields of a result store in stored order, which is sorted by
+// (struct, field name), for the merge in `refcnt diff`. The store is read a
+// line at a time; only the file table and the current field are kept.
+class StoreCursor {
+    public:
+    struct Field {
+        std::string owner;
+        std::string name;
+        std::string type;   // type label, or the type as written if untracked
+        std::string file;
+    };
+
+    // Reads the file table and moves to the first field.
+    bool open(const std::string &path, std::string &err) {
+        this->path = path;
+        is.open(path);
+        if (!is.is_open()) {
+            err = "cannot read '" + path + "'";
+            return false;
+        }
+        if (!getLine() || line != "refcnt-store 2") {
+            err = "'" + path + "' is not a result store";
+            return false;
+        }
+        return next(err);
+    }
+
+    bool atEnd() const {
+        return done;
+    }
+
+    const Field &get() const {
+        return current;
+    }
+
+    // Moves to the next record that has an owning struct
+    bool next(std::string &err) {
+        SmallVector<StringRef, 10> columns;
+        while (getLine()) {
+            columns.clear();
+            StringRef(line).split(columns, '\t');
+            if (columns[0] == "F" && columns.size() == 3) {
+                files.push_back(columns[2].str());
+                continue;
+            }
+            unsigned file = 0;
+            if (columns[0] != "R" || columns.size() != 10 ||
+                    columns[1].getAsInteger(10, file) || file >= files.size()) {
+                err = path + ":" + std::to_string(lineNumber) + ": malformed entry";
+                return false;
+            }
+            // Only fields have an owning struct
+            if (columns[8].empty()) {
+                continue;
+            }
+            Field field = {columns[8].str(), columns[6].str(),
+                           (columns[5] != "-" ? columns[5] : columns[7]).str(), files[file]};
+            if (std::tie(field.owner, field.name, field.type)
+                    < std::tie(current.owner, current.name, current.type)) {
+                err = path + ":" + std::to_string(lineNumber) + ": records are not sorted";
+                return false;
+            }
+            current = std::move(field);
+            return true;
+        }
+        done = true;
+        return true;
+    }
+
+    private:
+    bool getLine() {
+        while (std::getline(is, line)) {
+            ++lineNumber;
+            if (!line.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::string path;
+    std::ifstream is;
+    std::string line;
+    size_t lineNumber = 0;
+    std::vector<std::string> files;
+    Field current;
+    bool done = false;
+};
+
+// Compares two result stores with a merge join on (struct, field name) and
+// prints one line per difference, followed by the count of each type in
+// both stores:
+//
+//      + <struct> <field> <type> <file>                added in B
+//      - <struct> <field> <type> <file>                removed from A
+//      ~ <struct> <field> <type in A> -> <type in B>   type changed
+//
+// A key may occur several times (structs of the same name, nested fields),
+// in which case equal types are paired first and the rest are reported as
+// type changes while both sides have some left. Only the fields of one key
+// are held at a time.
+bool diffFields(raw_ostream &os, StoreCursor &A, StoreCursor &B, std::string &err)
+{
+    using Field = StoreCursor::Field;
+    std::map<std::string, std::pair<uint64_t, uint64_t>> types;
+    std::vector<Field> aGroup, bGroup;
+
+    while (!A.atEnd() || !B.atEnd()) {
+        // Find the next key and the group of each side having it
+        const Field &key = A.atEnd() ? B.get()
+                         : B.atEnd() ? A.get()
+                         : std::tie(A.get().owner, A.get().name)
+                               <= std::tie(B.get().owner, B.get().name) ? A.get() : B.get();
+        const std::string owner = key.owner, name = key.name;
+        auto readGroup = [&](StoreCursor &cursor, std::vector<Field> &group, bool inA) {
+            group.clear();
+            while (!cursor.atEnd() && cursor.get().owner == owner && cursor.get().name == name) {
+                auto &count = types[cursor.get().type];
+                ++(inA ? count.first : count.second);
+                group.push_back(cursor.get());
+                if (!cursor.next(err)) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        if (!readGroup(A, aGroup, true) || !readGroup(B, bGroup, false)) {
+            return false;
+        }
+
+        // Both groups are sorted by type: drop the pairs of equal types
+        std::vector<const Field *> removed, added;
+        auto a = aGroup.begin(), b = bGroup.begin();
+        while (a != aGroup.end() && b != bGroup.end()) {
+            if (a->type == b->type) {
+                ++a, ++b;
+            }
+            else if (a->type < b->type) {
+                removed.push_back(&*a++);
+            }
+            else {
+                added.push_back(&*b++);
+            }
+        }
+        for (; a != aGroup.end(); ++a) {
+            removed.push_back(&*a);
+        }
+        for (; b != bGroup.end(); ++b) {
+            added.push_back(&*b);
+        }
+
+        size_t i = 0;
+        for (; i < removed.size() && i < added.size(); ++i) {
+            os << "~\t" << owner << '\t' << name << '\t'
+               << removed[i]->type << " -> " << added[i]->type << '\n';
+        }
+        for (size_t j = i; j < removed.size(); ++j) {
+            os << "-\t" << owner << '\t' << name << '\t'
+               << removed[j]->type << '\t' << removed[j]->file << '\n';
+        }
+        for (size_t j = i; j < added.size(); ++j) {
+            os << "+\t" << owner << '\t' << name << '\t'
+               << added[j]->type << '\t' << added[j]->file << '\n';
+        }
+    }
+
+    os << "\n";
+    for (const auto &type : types) {
+        const int64_t delta = (int64_t)type.second.second - (int64_t)type.second.first;
+        if (delta == 0) {
+            continue;
+        }
+        os << type.first << ": " << type.second.first << " -> " << type.second.second
+           << format(" (%+lld)\n", (long long)delta);
+    }
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// LAYOUT REPORT
+// ----------------------------------------------------------------------------
+
+// The layout of a record holding tracked fields, flattened through
+// anonymous structs and unions. Offsets and sizes are in bits.
+struct RecordLayoutEntry {
+    struct Field {
+        std::string name;
+        std::string type;
+        uint64_t offset;
+        uint64_t size;
+        bool tracked;
+    };
+
+    std::string name;
+    std::string file;
+    unsigned line;
+    uint64_t size;
+    std::vector<Field> fields;      // sorted by offset
+};
+
+// Lays out the records of tracked fields during the traversal, while the
+// AST is still there, one entry per record and TU.
+class LayoutCollector {
+    public:
+    void addField(const FieldDecl *field, const SourceManager &SM) {
+        // Anonymous members are reported as part of the record they are in
+        const RecordDecl *RD = field->getParent();
+        while (RD->isAnonymousStructOrUnion()) {
+            const auto *parent = dyn_cast<RecordDecl>(RD->getParent());
+            if (parent == nullptr) {
+                break;
+            }
+            RD = parent;
+        }
+        if (RD->isInvalidDecl() || !RD->isCompleteDefinition()) {
+            return;
+        }
+
+        if (index.try_emplace(RD, entries.size()).second) {
+            const ASTContext &Ctx = field->getASTContext();
+            RecordLayoutEntry entry;
+            entry.name = getRecordName(RD);
+            const PresumedLoc loc = SM.getPresumedLoc(SM.getExpansionLoc(RD->getLocation()));
+            entry.file = loc.isValid() ? loc.getFilename() : "";
+            entry.line = loc.isValid() ? loc.getLine() : 0;
+            entry.size = Ctx.getTypeSize(Ctx.getRecordType(RD));
+
+            std::vector<std::pair<RecordLayoutEntry::Field, const FieldDecl *>> fields;
+            flatten(Ctx, RD, 0, fields);
+            std::stable_sort(fields.begin(), fields.end(), [](const auto &a, const auto &b) {
+                return a.first.offset < b.first.offset;
+            });
+            for (auto &f : fields) {
+                fieldIndex[f.second] = {(unsigned)entries.size(), (unsigned)entry.fields.size()};
+                entry.fields.push_back(std::move(f.first));
+            }
+            entries.push_back(std::move(entry));
+        }
+
+        auto it = fieldIndex.find(field);
+        if (it != fieldIndex.end()) {
+            entries[it->second.first].fields[it->second.second].tracked = true;
+        }
+    }
+
+    // Hands over the records laid out so far.
+    std::vector<RecordLayoutEntry> take() {
+        index.clear();
+        fieldIndex.clear();
+        std::vector<RecordLayoutEntry> ret = std::move(entries);
+        entries.clear();
+        return ret;
+    }
+
+    private:
+    static std::string getRecordName(const RecordDecl *RD) {
+        if (RD->getIdentifier() != nullptr) {
+            return (RD->getKindName() + " " + RD->getName()).str();
+        }
+        if (const TypedefNameDecl *TD = RD->getTypedefNameForAnonDecl()) {
+            return TD->getName().str();
+        }
+        return (RD->getKindName() + " (anonymous)").str();
+    }
+
+    void flatten(const ASTContext &Ctx, const RecordDecl *RD, uint64_t base,
+                 std::vector<std::pair<RecordLayoutEntry::Field, const FieldDecl *>> &out) {
+        static const LangOptions langOpts;
+        static const PrintingPolicy policy(langOpts);
+        const ASTRecordLayout &layout = Ctx.getASTRecordLayout(RD);
+
+        for (const FieldDecl *F : RD->fields()) {
+            const uint64_t offset = base + layout.getFieldOffset(F->getFieldIndex());
+            if (F->isAnonymousStructOrUnion()) {
+                if (const auto *RT = F->getType()->getAs<RecordType>()) {
+                    flatten(Ctx, RT->getDecl(), offset, out);
+                }
+                continue;
+            }
+            const uint64_t size = F->isBitField() ? F->getBitWidthValue(Ctx)
+                                                  : Ctx.getTypeSize(F->getType());
+            out.push_back({{F->getName().str(), F->getType().getAsString(policy),
+                            offset, size, false}, F});
+        }
+    }
+
+    llvm::DenseMap<const RecordDecl *, unsigned> index;
+    llvm::DenseMap<const FieldDecl *, std::pair<unsigned, unsigned>> fieldIndex;
+    std::vector<RecordLayoutEntry> entries;
+};
+
+// Collects the records laid out by all TUs and writes the report: for each
+// record with tracked fields, the cache line of every tracked field, the
+// other fields sharing that line (flagging atomics and locks, which are
+// written from other CPUs too) and the padding holes of the record.
+class LayoutReport {
+    public:
+    void add(std::vector<RecordLayoutEntry> records) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &record : records) {
+            entries.push_back(std::move(record));
+        }
+    }
+
+    bool write(StringRef path, unsigned cacheLine, std::string &err) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) {
+            return std::tie(a.file, a.line, a.name) < std::tie(b.file, b.line, b.name);
+        });
+
+        std::error_code EC;
+        raw_fd_ostream os(path, EC, llvm::sys::fs::OF_Text);
+        if (EC) {
+            err = "cannot write '" + path.str() + "': " + EC.message();
+            return false;
+        }
+
+        const uint64_t lineBits = cacheLine * 8;
+        for (const RecordLayoutEntry &entry : entries) {
+            os << entry.name << " (" << entry.file << ":" << entry.line << "), "
+               << entry.size / 8 << " bytes, "
+               << (entry.size + lineBits - 1) / lineBits << " cache lines\n";
+
+            for (const auto &field : entry.fields) {
+                if (!field.tracked) {
+                    continue;
+                }
+                const uint64_t first = field.offset / lineBits;
+                const uint64_t last = (field.offset + std::max<uint64_t>(field.size, 1) - 1) / lineBits;
+                os << "    " << field.name << " (" << field.type << ") at "
+                   << field.offset / 8 << ", cache line " << first;
+                if (last != first) {
+                    os << "-" << last;
+                }
+                os << "\n";
+
+                unsigned hot = 0;
+                std::string shared;
+                for (const auto &other : entry.fields) {
+                    const uint64_t otherFirst = other.offset / lineBits;
+                    const uint64_t otherLast = (other.offset + std::max<uint64_t>(other.size, 1) - 1) / lineBits;
+                    if (&other == &field || otherLast < first || otherFirst > last) {
+                        continue;
+                    }
+                    shared += shared.empty() ? "" : ", ";
+                    shared += other.name + " (" + other.type + ")";
+                    if (isAtomic(other.type)) {
+                        shared += " [atomic]";
+                        ++hot;
+                    }
+                    else if (isLock(other.type)) {
+                        shared += " [lock]";
+                        ++hot;
+                    }
+                }
+                if (!shared.empty()) {
+                    os << "        shares the line with " << hot << " atomics/locks: "
+                       << shared << "\n";
+                }
+            }
+
+            // Holes between fields and at the end, in whole bytes
+            std::string holes;
+            uint64_t end = 0;
+            auto addHole = [&](uint64_t from, uint64_t to) {
+                if (to / 8 > (from + 7) / 8) {
+                    holes += holes.empty() ? "" : ", ";
+                    holes += std::to_string(to / 8 - (from + 7) / 8) + " at " +
+                             std::to_string((from + 7) / 8);
+                }
+            };
+            for (const auto &field : entry.fields) {
+                if (field.offset > end) {
+                    addHole(end, field.offset);
+                }
+                end = std::max(end, field.offset + field.size);
+            }
+            if (entry.size > end) {
+                addHole(end, entry.size);
+            }
+            if (!holes.empty()) {
+                os << "    holes (bytes at offset): " << holes << "\n";
+            }
+            os << "\n";
+        }
+        return true;
+    }
+
+    private:
+    static bool isAtomic(StringRef type) {
+        return registry.classify(type) >= 0 || type.contains("atomic");
+    }
+
+    static bool isLock(StringRef type) {
+        for (StringRef lock : {"spinlock", "rwlock", "mutex", "semaphore", "seqlock", "seqcount"}) {
+            if (type.contains(lock)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::mutex mutex;
+    std::vector<RecordLayoutEntry> entries;
+};
+
+static LayoutReport layout_report;
+
+// ----------------------------------------------------------------------------
+// PERFORMANCE COUNTERS
+// ----------------------------------------------------------------------------
+
+static const char *const PERF_PHASE_NAMES[NUM_PERF_PHASES] = {"parse", "match", "output"};
+static const char *const PERF_COUNTER_NAMES[NUM_PERF_COUNTERS] = {
+    "cycles", "instructions", "LLC misses", "branch misses"
+};
+
+// Counters that could be opened on at least one thread, as a bit mask.
+static std::atomic<uint32_t> perf_available{0};
+static std::once_flag perf_warning;
+
+// Hardware counters of the calling thread, opened on first use as one
+// perf_event_open group so that they are read with a single syscall. The
+// counts between two calls to enterPhase are added to that phase in
+// match_stats. When the group shares the PMU with other events and was
+// only scheduled part of the time, the counts are scaled up by the time
+// enabled over the time running, and the reading is counted as scaled.
+// Counters the kernel or the CPU do not provide are left out, and if none
+// can be opened the run goes on without them.
+class PerfCounters {
+    public:
+    ~PerfCounters() {
+        for (int fd : fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    void enterPhase(PerfPhase phase) {
+        if (!perfCounters || !open()) {
+            return;
+        }
+        uint64_t now[NUM_PERF_COUNTERS] = {};
+        uint64_t enabled = 0, running = 0;
+        if (!read(now, enabled, running)) {
+            return;
+        }
+        if (current != PERF_PHASE_NONE) {
+            const uint64_t dEnabled = enabled - lastEnabled;
+            const uint64_t dRunning = running - lastRunning;
+            ++match_stats.perfReadings;
+            if (dRunning < dEnabled) {
+                ++match_stats.perfScaledReadings;
+            }
+            // Never scheduled in the phase: nothing to scale
+            if (dRunning != 0) {
+                const double scale = dRunning < dEnabled ? (double)dEnabled / dRunning : 1.0;
+                for (unsigned c = 0; c < NUM_PERF_COUNTERS; ++c) {
+                    match_stats.perf[current][c] += (uint64_t)((now[c] - last[c]) * scale);
+                }
+            }
+        }
+        std::copy(std::begin(now), std::end(now), std::begin(last));
+        lastEnabled = enabled;
+        lastRunning = running;
+        current = phase;
+    }
+
+    private:
+    enum { UNTRIED, OPEN, FAILED } state = UNTRIED;
+    int fds[NUM_PERF_COUNTERS] = {-1, -1, -1, -1};
+    // Counter of each value in the group read, in the order they were added
+    PerfCounter order[NUM_PERF_COUNTERS];
+    unsigned numOpen = 0;
+    uint64_t last[NUM_PERF_COUNTERS] = {};
+    uint64_t lastEnabled = 0;
+    uint64_t lastRunning = 0;
+    PerfPhase current = PERF_PHASE_NONE;
+
+    bool open() {
+        if (state != UNTRIED) {
+            return state == OPEN;
+        }
+        state = FAILED;
+
+        static const uint64_t configs[NUM_PERF_COUNTERS] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES,
+        };
+        int leader = -1;
+        for (unsigned c = 0; c < NUM_PERF_COUNTERS; ++c) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[c];
+            attr.disabled = leader < 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP
+                             | PERF_FORMAT_TOTAL_TIME_ENABLED
+                             | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            // This thread only, on any CPU
+            const int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+            if (fd < 0) {
+                if (leader < 0) {
+                    const int error = errno;
+                    std::call_once(perf_warning, [error]() {
+                        llvm::errs() << "warning: perf counters unavailable: "
+                                     << strerror(error) << "\n";
+                    });
+                    return false;
+                }
+                continue;
+            }
+            if (leader < 0) {
+                leader = fd;
+            }
+            fds[c] = fd;
+            order[numOpen++] = static_cast<PerfCounter>(c);
+            perf_available |= 1u << c;
+        }
+        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        state = OPEN;
+        return true;
+    }
+
+    bool read(uint64_t *values, uint64_t &enabled, uint64_t &running) {
+        // PERF_FORMAT_GROUP: the number of counters, the times the group was
+        // enabled and running, then the values of the counters
+        uint64_t buf[3 + NUM_PERF_COUNTERS];
+        const ssize_t size = ::read(fds[order[0]], buf, sizeof(buf));
+        if (size < static_cast<ssize_t>(sizeof(uint64_t) * (3 + numOpen))) {
+            return false;
+        }
+        enabled = buf[1];
+        running = buf[2];
+        for (unsigned i = 0; i < numOpen && i < buf[0]; ++i) {
+            values[order[i]] = buf[3 + i];
+        }
+        return true;
+    }
+};
+
+static thread_local PerfCounters perf_counters;
+
+// Prints the counts per phase, with instructions per cycle.
+void printPerfCounters(raw_ostream &os, const MatchStats &stats)
+{
+    const uint32_t available = perf_available;
+    if (available == 0) {
+        os << "perf counters: unavailable\n";
+        return;
+    }
+    os << "perf counters:\n";
+    for (unsigned p = 0; p < NUM_PERF_PHASES; ++p) {
+        os << "  " << PERF_PHASE_NAMES[p] << ":";
+        for (unsigned c = 0; c < NUM_PERF_COUNTERS; ++c) {
+            if (available & (1u << c)) {
+                os << " " << stats.perf[p][c] << " " << PERF_COUNTER_NAMES[c] << ",";
+            }
+        }
+        const uint64_t cycles = stats.perf[p][PERF_CYCLES];
+        os << format(" %.2f IPC\n", cycles ? (double)stats.perf[p][PERF_INSTRUCTIONS] / cycles : 0.0);
+    }
+    if (stats.perfScaledReadings != 0) {
+        os << "  warning: counters multiplexed in " << stats.perfScaledReadings
+           << " of " << stats.perfReadings << " readings, those counts are scaled"
+           << " estimates\n";
+    }
+}
+
+// ----------------------------------------------------------------------------
+// FIELD MATCHING
+// ----------------------------------------------------------------------------
+
+class TypeCheck : public MatchFinder::MatchCallback {
+    private:
+    // Per-TU storage. Everything below is reset in flush(), so nothing is
+    // carried over to (and counted again by) the next translation unit.
+    // TypeCheck is owned by the TU's consumer, so the containers and the
+    // arena are allocated again for every TU; --stats reports the heap
+    // allocations matching makes in builds with REFCNT_COUNT_ALLOCS.
+    llvm::BumpPtrAllocator arena;
+    llvm::StringSaver strings{arena};
+    llvm::StringMap<int> fileIndex;     // source file -> index, -1 if already logged
+    std::vector<StringRef> logFiles;
+    std::vector<Refcnt> fileCounts;
+    std::vector<MatchRecord> records;
+    std::shared_ptr<MacroContext> macros;
+
+    // Every file with matches and all of their matches, logged here or not,
+    // for --result-store.
+    llvm::StringMap<unsigned> storeIndex;
+    std::vector<StringRef> storeFiles;
+    std::vector<MatchRecord> storeRecords;
+
+    // Records of logged tracked fields, for --layout-report
+    LayoutCollector layouts;
+
+    unsigned getStoreIndex(StringRef srcFile) {
+        auto inserted = storeIndex.try_emplace(srcFile, storeFiles.size());
+        if (inserted.second) {
+            storeFiles.push_back(inserted.first->getKey());
+        }
+        return inserted.first->second;
+    }
+
+    // Returns the index of the log file for srcFile, or -1 if that file was
+    // already logged by another translation unit.
+    int getFileIndex(StringRef srcFile) {
+        auto inserted = fileIndex.try_emplace(srcFile, -1);
+        if (!inserted.second) {
+            return inserted.first->second;
+        }
+
+        // Shards only fill the result store; `refcnt merge` writes the logs
+        if (!shard.empty()) {
+            return -1;
+        }
+
+        SmallString<PATH_MAX> logFile(LOG_DIR);
+        logFile += srcFile;
+        if (!log_claims.claim(logFile)) {
+            return -1;
+        }
+
+        inserted.first->second = logFiles.size();
+        logFiles.push_back(strings.save(logFile.str()));
+        fileCounts.emplace_back();
+        return inserted.first->second;
+    }
+
+    // Writes every log file collected for the current translation unit,
+    // adds its counts to total_refcnt exactly once and releases the entries.
+    void flush() {
+        perf_counters.enterPhase(PERF_PHASE_OUTPUT);
+        std::stable_sort(records.begin(), records.end(),
+            [](const MatchRecord &a, const MatchRecord &b) {
+                return a.file < b.file;
+            });
+
+        size_t begin = 0;
+        for (unsigned i = 0; i < logFiles.size(); ++i) {
+            size_t end = begin;
+            while (end < records.size() && records[end].file == i) {
+                ++end;
+            }
+            const ArrayRef<MatchRecord> fileRecords(records.data() + begin, end - begin);
+            const StringRef srcFile = logFiles[i].drop_front(sizeof(LOG_DIR) - 1);
+            writeLog(logFiles[i], fileRecords, fileCounts[i]);
+            addFileTotals(srcFile, fileRecords, fileCounts[i]);
+            begin = end;
+        }
+
+        if (!layoutReport.empty()) {
+            layout_report.add(layouts.take());
+        }
+
+        if (!resultStore.empty()) {
+            std::stable_sort(storeRecords.begin(), storeRecords.end(),
+                [](const MatchRecord &a, const MatchRecord &b) {
+                    return a.file < b.file;
+                });
+            begin = 0;
+            for (unsigned i = 0; i < storeFiles.size(); ++i) {
+                size_t end = begin;
+                while (end < storeRecords.size() && storeRecords[end].file == i) {
+                    ++end;
+                }
+                result_store.add(tu_ordinal, storeFiles[i],
+                                 ArrayRef<MatchRecord>(storeRecords.data() + begin, end - begin));
+                begin = end;
+            }
+            storeRecords.clear();
+            storeFiles.clear();
+            storeIndex.clear();
+        }
+
+        if (macros) {
+            match_stats.typeMacroExpansions += macros->typeExpansions;
+            match_stats.apiMacroExpansions += macros->apiExpansions;
+            macros->typeExpansions = macros->apiExpansions = 0;
+        }
+
+        match_stats.arenaBytes += arena.getBytesAllocated();
+
+        records.clear();
+        logFiles.clear();
+        fileCounts.clear();
+        fileIndex.clear();
+        arena.Reset();
+    }
+
+    public:
+    // Attributes matches to tracked macros recorded by RefcntPPCallbacks.
+    void setMacroContext(std::shared_ptr<MacroContext> context) {
+        macros = std::move(context);
+    }
+
+    virtual void onEndOfTranslationUnit() override {
+        flush();
+    }
+
+    virtual void run(const MatchFinder::MatchResult& Result) override {
+        const clang::DeclaratorDecl *node = Result.Nodes.getNodeAs<clang::DeclaratorDecl>("refcntType");
+
+        if (node == nullptr) {
+            return;
+        }
+        record(node, *Result.SourceManager);
+    }
+
+    // Names the top-level struct of a field, falling back to the typedef of
+    // an anonymous struct, and to where it is declared if it has neither, so
+    // that anonymous structs do not share one key in refcnt diff.
+    StringRef getOwnerName(const FieldDecl *field, const SourceManager &SM) {
+        const RecordDecl *top = getTopLevelStruct(field);
+        if (top == nullptr) {
+            return StringRef();
+        }
+        if (top->getIdentifier() != nullptr) {
+            return strings.save(top->getName());
+        }
+        if (const TypedefNameDecl *TD = top->getTypedefNameForAnonDecl()) {
+            return strings.save(TD->getName());
+        }
+        const SourceLocation loc = top->getBeginLoc();
+        return strings.save("(anonymous at " + SM.getFilename(SM.getSpellingLoc(loc)) + ":"
+                            + Twine(SM.getExpansionLineNumber(loc)) + ")");
+    }
+
+    // Records a matched declaration. Shared by the matcher and visitor engines.
+    void record(const DeclaratorDecl *node, const SourceManager &SM) {
+        const auto &loc = node->getBeginLoc();
+        const StringRef srcFile = SM.getFilename(SM.getSpellingLoc(loc));
+
+        if (srcFile.empty()) {
+            llvm::errs() << "Path empty!\n";
+            return;
+        }
+
+        const int file = getFileIndex(srcFile);
+        const bool store = !resultStore.empty();
+        if (file < 0 && tu_file_counts == nullptr && tu_main_counts == nullptr && !store) {
+            return;
+        }
+
+        // Same spelling as QualType::getAsString(), printed into a stack
+        // buffer and saved in the arena instead of a fresh std::string.
+        static const LangOptions langOpts;
+        static const PrintingPolicy policy(langOpts);
+        SmallString<64> typeBuf;
+        llvm::raw_svector_ostream typeOS(typeBuf);
+        node->getType().print(typeOS, policy);
+
+        const int tracked = registry.classify(typeBuf.str());
+        if (tracked >= 0 && tu_file_counts != nullptr) {
+            ++(*tu_file_counts)[srcFile].cnt[tracked];
+        }
+        // Whether or not this TU logs its main file, so that the estimate
+        // does not depend on the log directory or on thread timing
+        if (tracked >= 0 && tu_main_counts != nullptr && SM.isWrittenInMainFile(SM.getSpellingLoc(loc))) {
+            ++tu_main_counts->cnt[tracked];
+        }
+        if (file < 0 && !store) {
+            return;
+        }
+        if (file >= 0 && tracked >= 0) {
+            ++fileCounts[file].cnt[tracked];
+        }
+        const StringRef type = strings.save(typeBuf.str());
+
+        StringRef macro;
+        if (macros) {
+            macro = macros->lookup(SM, loc);
+            if (!macro.empty()) {
+                macro = strings.save(macro);
+                ++match_stats.macroMatches;
+            }
+        }
+
+        StringRef owner;
+        if (const auto *field = dyn_cast<FieldDecl>(node)) {
+            owner = getOwnerName(field, SM);
+            if (file >= 0 && tracked >= 0 && !layoutReport.empty()) {
+                layouts.addField(field, SM);
+            }
+        }
+
+        MatchRecord rec = {
+            0,
+            SM.getExpansionLineNumber(loc),
+            SM.getExpansionColumnNumber(loc),
+            strings.save(node->getName()),
+            type,
+            macro,
+            owner,
+            tracked
+        };
+        if (store) {
+            rec.file = getStoreIndex(srcFile);
+            storeRecords.push_back(rec);
+        }
+        if (file >= 0) {
+            rec.file = file;
+            records.push_back(rec);
+            ++match_stats.matches;
+        }
+    }
+};
+
+// The visitor engine: a hand-written traversal that reports exactly the
+// FieldDecls the matcher above would. Tracked types are recognised by
+// looking up the typedef or record declaration in a per-TU cache instead
+// of running the generic matchers, and the excluded records are tracked on
+// the way down instead of walking hasAncestor for every field.
+class RefcntVisitor : public RecursiveASTVisitor<RefcntVisitor> {
+    public:
+    RefcntVisitor(TypeCheck &callback, const SourceManager &SM)
+    : callback(callback), SM(SM) {
+        for (const auto &type : registry.types) {
+            (type.kind == TrackedType::TYPEDEF ? typedefNames : recordNames).insert(type.name);
+        }
+        for (const auto &name : registry.excluded) {
+            excludedNames.insert(name);
+        }
+    }
+
+    // Walk the same nodes as MatchFinder does by default.
+    bool shouldVisitTemplateInstantiations() const { return true; }
+    bool shouldVisitImplicitCode() const { return true; }
+
+    bool TraverseRecordDecl(RecordDecl *D) {
+        const unsigned excluded = isExcluded(D);
+        excludedDepth += excluded;
+        const bool ret = RecursiveASTVisitor::TraverseRecordDecl(D);
+        excludedDepth -= excluded;
+        return ret;
+    }
+
+    bool TraverseCXXRecordDecl(CXXRecordDecl *D) {
+        const unsigned excluded = isExcluded(D);
+        excludedDepth += excluded;
+        const bool ret = RecursiveASTVisitor::TraverseCXXRecordDecl(D);
+        excludedDepth -= excluded;
+        return ret;
+    }
+
+    bool VisitFieldDecl(FieldDecl *D) {
+        if (excludedDepth == 0 && isTracked(D->getType())) {
+            callback.record(D, SM);
+        }
+        return true;
+    }
+
+    private:
+    TypeCheck &callback;
+    const SourceManager &SM;
+    llvm::StringSet<> typedefNames, recordNames, excludedNames;
+    llvm::DenseMap<const Decl *, bool> trackedDecls;
+    unsigned excludedDepth = 0;
+
+    bool isExcluded(const RecordDecl *D) const {
+        return D->getDeclName().isIdentifier() && excludedNames.contains(D->getName());
+    }
+
+    // Mirrors hasType(typedefNameDecl(...)) / hasType(recordDecl(...)):
+    // only elaborated sugar is looked through, everything else has to name
+    // the tracked declaration directly.
+    bool isTracked(QualType QT) {
+        const Type *T = QT.getTypePtrOrNull();
+        while (const auto *ET = dyn_cast_or_null<ElaboratedType>(T)) {
+            T = ET->getNamedType().getTypePtrOrNull();
+        }
+
+        const NamedDecl *D = nullptr;
+        const llvm::StringSet<> *names = nullptr;
+        if (const auto *TT = dyn_cast_or_null<TypedefType>(T)) {
+            D = TT->getDecl();
+            names = &typedefNames;
+        }
+        else if (const auto *RT = dyn_cast_or_null<RecordType>(T)) {
+            D = RT->getDecl();
+            names = &recordNames;
+        }
+        else {
+            return false;
+        }
+
+        auto inserted = trackedDecls.try_emplace(D, false);
+        if (inserted.second) {
+            inserted.first->second = D->getDeclName().isIdentifier() && names->contains(D->getName());
+        }
+        return inserted.first->second;
+    }
+};
+
+// class IncludeRewriteCallback : public clang::PPCallbacks {
+//     public:
+//     virtual void InclusionDirective(
+//         SourceLocation HashLoc,
+//         const Token &IncludeTok, StringRef FileName,
+//         bool IsAngled, CharSourceRange FilenameRange,
+//         OptionalFileEntryRef File,
+//         StringRef SearchPath, StringRef RelativePath,
+//         const Module *SuggestedModule,
+//         bool ModuleImported,
+//         SrcMgr::CharacteristicKind FileType) override {
+        
+//     }
+
+//     private:
+//     Rewriter rewriter;
+//     const SourceManager &SM;
+// };
+
+// ----------------------------------------------------------------------------
+// INCLUDE INDEX
+// ----------------------------------------------------------------------------
+
+// Layout of the reverse include index file. All integers are 32-bit in host
+// byte order and offsets are from the start of the file:
+//
+//      IndexFileHeader
+//      IndexEntry      headers[numHeaders]     sorted by path
+//      IndexString     tus[numTUs]
+//      uint32_t        postings[]              TU ids of each header
+//      char            strings[]
+//
+// Readers map the file and binary-search the header table, so a lookup
+// touches a handful of pages and nothing is parsed up front.
+struct IndexFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numHeaders;
+    uint32_t numTUs;
+};
+
+struct IndexString {
+    uint32_t offset;
+    uint32_t size;
+};
+
+struct IndexEntry {
+    IndexString path;
+    uint32_t postings;
+    uint32_t numPostings;
+};
+
+static constexpr uint32_t INDEX_MAGIC = 0x49434e52;    // "RNCI"
+static constexpr uint32_t INDEX_VERSION = 1;
+
+// Read-only view of an index file.
+class IncludeIndex {
+    public:
+    bool load(StringRef path, std::string &err) {
+        auto file = llvm::MemoryBuffer::getFile(path, /*IsText=*/false,
+                                                /*RequiresNullTerminator=*/false);
+        if (!file) {
+            err = "cannot read '" + path.str() + "': " + file.getError().message();
+            return false;
+        }
+        buffer = std::move(*file);
+
+        const size_t size = buffer->getBufferSize();
+        if (size < sizeof(IndexFileHeader)) {
+            err = "'" + path.str() + "' is not an include index";
+            return false;
+        }
+        header = reinterpret_cast<const IndexFileHeader *>(buffer->getBufferStart());
+        if (header->magic != INDEX_MAGIC || header->version != INDEX_VERSION) {
+            err = "'" + path.str() + "' is not an include index";
+            return false;
+        }
+
+        const uint64_t tables = sizeof(IndexFileHeader)
+                                + (uint64_t)header->numHeaders * sizeof(IndexEntry)
+                                + (uint64_t)header->numTUs * sizeof(IndexString);
+        if (tables > size) {
+            err = "'" + path.str() + "' is truncated";
+            return false;
+        }
+        entries = reinterpret_cast<const IndexEntry *>(header + 1);
+        tus = reinterpret_cast<const IndexString *>(entries + header->numHeaders);
+        return true;
+    }
+
+    // Returns the TUs including `path`, directly or not.
+    SmallVector<StringRef, 8> lookup(StringRef path) const {
+        SmallVector<StringRef, 8> ret;
+        const IndexEntry *end = entries + header->numHeaders;
+        const IndexEntry *it = std::lower_bound(entries, end, path,
+            [this](const IndexEntry &entry, StringRef key) {
+                return str(entry.path) < key;
+            });
+        if (it != end && str(it->path) == path) {
+            collect(*it, ret);
+        }
+        return ret;
+    }
+
+    // Calls fn(header, tu) for every edge of the index.
+    template <typename Fn>
+    void forEachEdge(Fn fn) const {
+        SmallVector<StringRef, 8> includers;
+        for (uint32_t i = 0; i < header->numHeaders; i++) {
+            includers.clear();
+            collect(entries[i], includers);
+            for (StringRef tu : includers) {
+                fn(str(entries[i].path), tu);
+            }
+        }
+    }
+
+    private:
+    // Strings and postings are bounds-checked on access rather than at load
+    // time, so opening a large index stays O(1).
+    StringRef str(const IndexString &s) const {
+        if ((uint64_t)s.offset + s.size > buffer->getBufferSize()) {
+            return StringRef();
+        }
+        return StringRef(buffer->getBufferStart() + s.offset, s.size);
+    }
+
+    void collect(const IndexEntry &entry, SmallVectorImpl<StringRef> &out) const {
+        if ((uint64_t)entry.postings + (uint64_t)entry.numPostings * sizeof(uint32_t)
+                > buffer->getBufferSize()) {
+            return;
+        }
+        const auto *ids = reinterpret_cast<const uint32_t *>(
+            buffer->getBufferStart() + entry.postings);
+        for (uint32_t i = 0; i < entry.numPostings; i++) {
+            if (ids[i] < header->numTUs) {
+                out.push_back(str(tus[ids[i]]));
+            }
+        }
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> buffer;
+    const IndexFileHeader *header = nullptr;
+    const IndexEntry *entries = nullptr;
+    const IndexString *tus = nullptr;
+};
+
+// Include edges collected while analysing, written out as an IncludeIndex
+// at the end of the run.
+class IncludeGraph {
+    public:
+    // Records that translation unit `tu` includes each of `headers`.
+    void addTU(StringRef tu, const std::vector<std::string> &headers) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const uint32_t id = getTUId(tu);
+        for (const std::string &h : headers) {
+            includers[h].push_back(id);
+        }
+    }
+
+    // Carries over the edges of `previous` whose TU was not analysed in
+    // this run, so partial runs refine an index instead of truncating it.
+    void merge(const IncludeIndex &previous) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const size_t analysed = tus.size();
+        previous.forEachEdge([&](StringRef header, StringRef tu) {
+            auto it = tuIds.find(tu);
+            if (it != tuIds.end() && it->second < analysed) {
+                return;
+            }
+            includers[header].push_back(getTUId(tu));
+        });
+    }
+
+    bool write(StringRef path, std::string &err) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        std::vector<StringMapEntry<std::vector<uint32_t>> *> sorted;
+        sorted.reserve(includers.size());
+        size_t numPostings = 0;
+        for (auto &entry : includers) {
+            // A TU may be compiled more than once by the database
+            auto &ids = entry.second;
+            std::sort(ids.begin(), ids.end());
+            ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+            numPostings += ids.size();
+            sorted.push_back(&entry);
+        }
+        std::sort(sorted.begin(), sorted.end(), [](const auto *a, const auto *b) {
+            return a->getKey() < b->getKey();
+        });
+
+        IndexFileHeader header = {INDEX_MAGIC, INDEX_VERSION,
+                                  (uint32_t)sorted.size(), (uint32_t)tus.size()};
+        const uint64_t postingsStart = sizeof(IndexFileHeader)
+                                       + sorted.size() * sizeof(IndexEntry)
+                                       + tus.size() * sizeof(IndexString);
+        const uint64_t stringsStart = postingsStart + numPostings * sizeof(uint32_t);
+
+        std::string strings;
+        auto addString = [&](StringRef s) {
+            IndexString ret = {(uint32_t)(stringsStart + strings.size()), (uint32_t)s.size()};
+            strings += s;
+            return ret;
+        };
+
+        std::vector<IndexEntry> entries;
+        entries.reserve(sorted.size());
+        uint64_t postings = postingsStart;
+        for (const auto *entry : sorted) {
+            entries.push_back({addString(entry->getKey()), (uint32_t)postings,
+                               (uint32_t)entry->second.size()});
+            postings += entry->second.size() * sizeof(uint32_t);
+        }
+        std::vector<IndexString> tuStrings;
+        tuStrings.reserve(tus.size());
+        for (const std::string &tu : tus) {
+            tuStrings.push_back(addString(tu));
+        }
+        if (stringsStart + strings.size() > UINT32_MAX) {
+            err = "include index exceeds 4 GiB";
+            return false;
+        }
+
+        // Written next to the target and renamed over it, so concurrent
+        // readers never map a partial file.
+        const std::string tmp = path.str() + ".tmp";
+        {
+            std::error_code EC;
+            raw_fd_ostream os(tmp, EC, llvm::sys::fs::OF_None);
+            if (EC) {
+                err = "cannot write '" + tmp + "': " + EC.message();
+                return false;
+            }
+            os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            os.write(reinterpret_cast<const char *>(entries.data()),
+                     entries.size() * sizeof(IndexEntry));
+            os.write(reinterpret_cast<const char *>(tuStrings.data()),
+                     tuStrings.size() * sizeof(IndexString));
+            for (const auto *entry : sorted) {
+                os.write(reinterpret_cast<const char *>(entry->second.data()),
+                         entry->second.size() * sizeof(uint32_t));
+            }
+            os << strings;
+            if (os.has_error()) {
+                err = "cannot write '" + tmp + "': " + os.error().message();
+                os.clear_error();
+                return false;
+            }
+        }
+        if (auto EC = llvm::sys::fs::rename(tmp, path)) {
+            err = "cannot write '" + path.str() + "': " + EC.message();
+            return false;
+        }
+        return true;
+    }
+
+    private:
+    uint32_t getTUId(StringRef tu) {
+        auto inserted = tuIds.try_emplace(tu, tus.size());
+        if (inserted.second) {
+            tus.push_back(tu.str());
+        }
+        return inserted.first->second;
+    }
+
+    std::mutex mutex;
+    std::vector<std::string> tus;
+    llvm::StringMap<uint32_t> tuIds;
+    llvm::StringMap<std::vector<uint32_t>> includers;
+};
+
+static IncludeGraph include_graph;
+
+// Collects every file a translation unit includes, directly or not, and
+// adds them to include_graph once the TU is done. That is when the
+// preprocessor is destroyed rather than at EndOfMainFile, which is not
+// reached when parsing stops at the error budget.
+class IncludeCollector : public PPCallbacks {
+    public:
+    IncludeCollector(FileManager &FM, StringRef tu) : FM(FM), tu(absolute(FM, tu)) {}
+
+    virtual ~IncludeCollector() override {
+        include_graph.addTU(tu, headers);
+    }
+
+    virtual void InclusionDirective(
+        SourceLocation HashLoc,
+        const Token &IncludeTok, StringRef FileName,
+        bool IsAngled, CharSourceRange FilenameRange,
+        OptionalFileEntryRef File,
+        StringRef SearchPath, StringRef RelativePath,
+        const Module *SuggestedModule,
+        bool ModuleImported,
+        SrcMgr::CharacteristicKind FileType) override {
+
+        // Include guards make most directives repeats, so only the first
+        // one for each file pays for the path lookup.
+        if (!File || !seen.insert(&File->getFileEntry()).second) {
+            return;
+        }
+        headers.push_back(absolute(FM, File->getName()));
+    }
+
+    private:
+    static std::string absolute(FileManager &FM, StringRef path) {
+        SmallString<PATH_MAX> ret(path);
+        FM.makeAbsolutePath(ret);
+        llvm::sys::path::remove_dots(ret, /*remove_dot_dot=*/true);
+        return ret.str().str();
+    }
+
+    FileManager &FM;
+    std::string tu;
+    llvm::DenseSet<const FileEntry *> seen;
+    std::vector<std::string> headers;
+};
+
+// ----------------------------------------------------------------------------
+// PROGRESS
+// ----------------------------------------------------------------------------
+
+// Reports progress of a long run every --progress seconds. The analysis
+// threads only touch a few counters per TU: TU and match counts are atomics,
+// and each thread publishes the TU it is parsing in its own slot, whose lock
+// is only contended when the reporter takes a snapshot.
+class ProgressReporter {
+    public:
+    void start(size_t totalTUs) {
+        if (progressInterval == 0) {
+            return;
+        }
+        total = totalTUs;
+        doneTUs = 0;
+        doneMatches = 0;
+        startTime = std::chrono::steady_clock::now();
+        stopping = false;
+        reporter = std::thread([this]() { run(); });
+    }
+
+    void stop() {
+        if (!reporter.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        reporter.join();
+        report(/*final=*/true);
+    }
+
+    void beginTU(StringRef file) {
+        if (!reporter.joinable()) {
+            return;
+        }
+        if (currentSlot == nullptr) {
+            currentSlot = acquireSlot();
+        }
+        if (Slot *slot = currentSlot) {
+            std::lock_guard<std::mutex> guard(slot->lock);
+            slot->file = file.str();
+            slot->start = std::chrono::steady_clock::now();
+            slot->busy = true;
+        }
+    }
+
+    void endTU(uint64_t matches) {
+        if (!reporter.joinable()) {
+            return;
+        }
+        if (Slot *slot = currentSlot) {
+            {
+                std::lock_guard<std::mutex> guard(slot->lock);
+                slot->busy = false;
+            }
+            releaseSlot(slot);
+            currentSlot = nullptr;
+        }
+        doneTUs.fetch_add(1, std::memory_order_relaxed);
+        doneMatches.fetch_add(matches, std::memory_order_relaxed);
+    }
+
+    private:
+    static constexpr size_t MAX_SLOTS = 256;
+    static constexpr size_t SLOWEST = 3;
+
+    struct Slot {
+        std::mutex lock;
+        std::string file;
+        std::chrono::steady_clock::time_point start;
+        bool busy = false;
+    };
+
+    size_t total = 0;
+    std::chrono::steady_clock::time_point startTime;
+    std::atomic<uint64_t> doneTUs{0};
+    std::atomic<uint64_t> doneMatches{0};
+    std::atomic<size_t> usedSlots{0};
+    Slot slots[MAX_SLOTS];
+    std::vector<Slot *> freeSlots;
+    static inline thread_local Slot *currentSlot = nullptr;
+
+    std::thread reporter;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    // A slot is held for the duration of one TU, so the fresh threads of
+    // every parallelFor reuse the slots of the finished ones. TUs beyond
+    // MAX_SLOTS in flight at once are counted but not shown.
+    Slot *acquireSlot() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!freeSlots.empty()) {
+            Slot *slot = freeSlots.back();
+            freeSlots.pop_back();
+            return slot;
+        }
+        return usedSlots < MAX_SLOTS ? &slots[usedSlots++] : nullptr;
+    }
+
+    void releaseSlot(Slot *slot) {
+        std::lock_guard<std::mutex> guard(lock);
+        freeSlots.push_back(slot);
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (!wake.wait_for(guard, std::chrono::seconds(progressInterval),
+                              [this]() { return stopping; })) {
+            guard.unlock();
+            report(/*final=*/false);
+            guard.lock();
+        }
+    }
+
+    void report(bool final) {
+        const auto now = std::chrono::steady_clock::now();
+        const double elapsed = std::chrono::duration<double>(now - startTime).count();
+        const uint64_t done = doneTUs.load(std::memory_order_relaxed);
+        const uint64_t matches = doneMatches.load(std::memory_order_relaxed);
+        const double rate = elapsed > 0 ? done / elapsed : 0;
+
+        std::vector<std::pair<double, std::string>> inFlight;
+        for (size_t i = 0; i < std::min(usedSlots.load(), MAX_SLOTS); ++i) {
+            std::lock_guard<std::mutex> guard(slots[i].lock);
+            if (slots[i].busy) {
+                inFlight.emplace_back(
+                    std::chrono::duration<double>(now - slots[i].start).count(), slots[i].file);
+            }
+        }
+        std::sort(inFlight.begin(), inFlight.end(), std::greater<>());
+
+        std::string text;
+        llvm::raw_string_ostream os(text);
+        os << done << "/" << total << " TUs"
+           << format(" (%.1f%%)", total ? 100.0 * done / total : 100.0)
+           << format(", %.1f TUs/s, %.0f matches/s", rate, elapsed > 0 ? matches / elapsed : 0.0)
+           << format(", %.0f s elapsed", elapsed);
+        if (!final && rate > 0) {
+            os << format(", ETA %.0f s", (total - std::min<uint64_t>(done, total)) / rate);
+        }
+        os << "\n";
+        for (size_t i = 0; i < inFlight.size() && i < SLOWEST; ++i) {
+            os << "  " << format("%.1f s", inFlight[i].first) << " " << inFlight[i].second << "\n";
+        }
+        os.flush();
+
+        if (statusFile.empty()) {
+            llvm::errs() << "progress: " << text;
+            return;
+        }
+        // Replaced atomically so that readers never see a partial status
+        const std::string tmp = statusFile + ".tmp";
+        {
+            std::error_code EC;
+            llvm::raw_fd_ostream out(tmp, EC);
+            if (EC) {
+                return;
+            }
+            out << text;
+        }
+        llvm::sys::fs::rename(tmp, statusFile);
+    }
+};
+
+static ProgressReporter progress;
+
+// ----------------------------------------------------------------------------
+// REGISTERING CALLBACKS
+// ----------------------------------------------------------------------------
+
+// The ASTConsumer allows us to dictate:
+//      - which AST nodes we match, and
+//      - how we want to handle those matched nodes
+class RefcntASTConsumer : public ASTConsumer {
+
+    public:
+    RefcntASTConsumer(clang::Preprocessor& PP) {
+    
+        // Here we add all of the checks that should be run
+        // when the AST is traversed by using Matcher.addMatcher
+
+        // At the moment, there are no checks registered
+
+        if (macroContext) {
+            auto context = std::make_shared<MacroContext>();
+            PP.addPPCallbacks(std::make_unique<RefcntPPCallbacks>(PP.getSourceManager(), context));
+            Callback.setMacroContext(std::move(context));
+        }
+
+        if (engine != Engine::MATCHER) {
+            return;
+        }
+
+        // All tracked types share a single matcher, so adding types to the
+        // registry does not add traversals.
+        Matcher.addMatcher(
+            fieldDecl(
+                anyOf(
+                    hasType(typedefNameDecl(hasAnyName(
+                        registry.names(TrackedType::TYPEDEF)
+                    ))),
+                    hasType(recordDecl(hasAnyName(
+                        registry.names(TrackedType::RECORD)
+                    )))
+                ),
+                unless(hasAncestor(recordDecl(hasAnyName(
+                    registry.excludedNames()
+                ))))
+            ).bind("refcntType"),
+            &Callback
+        );
+        // Matcher.addMatcher(
+        //     declaratorDecl(
+        //         matchesName(".*ref.*"),
+        //         unless(anyOf(
+        //             hasType(typedefNameDecl(hasAnyName(
+        //                 "atomic_t",
+        //                 "atomic_long_t",
+        //                 "atomic64_t",
+        //                 "refcount_t"
+        //             ))),
+        //             hasType(recordDecl(hasName("kref")))
+        //         )),
+        //         anyOf(
+        //             varDecl(),
+        //             fieldDecl()
+        //         )
+        //     ).bind("refcntName"),
+        //     callback
+        // );
+    }
+
+    void HandleTranslationUnit(ASTContext& Context) override {
+        perf_counters.enterPhase(PERF_PHASE_MATCH);
+        const auto start = std::chrono::steady_clock::now();
+        const uint64_t allocsAtStart = heap_allocs;
+
+        switch (engine) {
+        case Engine::MATCHER:
+            Matcher.matchAST(Context);
+            break;
+        case Engine::VISITOR:
+            Callback.onStartOfTranslationUnit();
+            RefcntVisitor(Callback, Context.getSourceManager())
+                .TraverseDecl(Context.getTranslationUnitDecl());
+            Callback.onEndOfTranslationUnit();
+            break;
+        case Engine::LEXER:
+            // Does not parse, see LexerEstimator
+            break;
+        }
+
+        match_stats.heapAllocs += heap_allocs - allocsAtStart;
+        match_stats.traversalSeconds += std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+    void Initialize(ASTContext &Context) override {
+        this->Context = &Context;
+    }
+
+    // Returning false makes ParseAST stop before the end of the file without
+    // calling HandleTranslationUnit, so the declarations parsed up to the
+    // stop are matched here instead.
+    bool HandleTopLevelDecl(DeclGroupRef D) override {
+        if (!isOverErrorBudget()) {
+            return true;
+        }
+        HandleTranslationUnit(*Context);
+        return false;
+    }
+
+    static bool isOverErrorBudget() {
+        return errorBudget != 0 && tu_errors.count >= errorBudget;
+    }
+
+    private:
+    ASTContext *Context = nullptr;
+    // Owned by the consumer so that the per-TU match state is released
+    // together with the translation unit instead of being leaked.
+    TypeCheck Callback;
+    MatchFinder Matcher;
+};
+
+// The FrontEndAction is the main entry point for the clang tooling library
+// and allows us to add callbacks via:
+//      PPCallback classes  - for callbacks involving the preprocessor
+//      ASTConsumer classes - for callbacks involving AST nodes 
+class RefcntFrontEndAction : public ASTFrontendAction {
+
+    public:
+    virtual bool BeginSourceFileAction(CompilerInstance &CI) override {
+        const auto &SM = CI.getSourceManager();
+        
+        // const std::string &filePath = SM.getFileEntryForID(SM.getMainFileID())->tryGetRealPathName().str();
+
+        // llvm::outs() << "File path: " << filePath << "\n";
+
+        // Read by ASTFrontendAction::ExecuteAction when it starts parsing,
+        // which is after this callback.
+        CI.getFrontendOpts().SkipFunctionBodies = skipFunctionBodies;
+
+        tu_errors = TUErrors();
+        tuMatches = match_stats.matches;
+        progress.beginTU(getCurrentFile());
+        perf_counters.enterPhase(PERF_PHASE_PARSE);
+        start = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    virtual std::unique_ptr<ASTConsumer> CreateASTConsumer(
+            CompilerInstance& CI, StringRef file) override {
+
+        // Here we add any checks which require the preprocessor.
+        // At the moment, there are no checks registered
+
+        if (!writeIncludeIndex.empty()) {
+            CI.getPreprocessor().addPPCallbacks(
+                std::make_unique<IncludeCollector>(CI.getFileManager(), file));
+        }
+
+        return std::unique_ptr<ASTConsumer>(
+                new RefcntASTConsumer(CI.getPreprocessor()));
+    }
+
+    virtual void EndSourceFileAction() override {
+        match_stats.tuSeconds += std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+        if (tu_errors.count != 0) {
+            broken_tus.add(getCurrentFile(), tu_errors,
+                           RefcntASTConsumer::isOverErrorBudget());
+        }
+        progress.endTU(match_stats.matches - tuMatches);
+        perf_counters.enterPhase(PERF_PHASE_NONE);
+    }
+
+    // virtual bool ParseArgs(
+    //     const CompilerInstance &CI,
+    //     const std::vector<std::string> &Args
+    // ) override {
+    //     return true;
+    // }
+
+    private:
+    std::chrono::steady_clock::time_point start;
+    uint64_t tuMatches = 0;
+};
+
+// static FrontendPluginRegistry::Add<RefcntFrontEndAction> X("refcnt-plugin", "find refcnt");
+
+// ----------------------------------------------------------------------------
+// FILE CACHE
+// ----------------------------------------------------------------------------
+
+// Stat results and header contents shared by every tool and thread of an
+// analysis pass. Only files that exist are cached: a failed lookup along the
+// include path is repeated, so a header generated during the run is found.
+// Header contents are cached up to --file-cache-limit; headers read after
+// that are read by every TU. Buffers are only released by clear(), once no
+// TU of the pass is left holding a reference into them.
+class SharedFileCache {
+    public:
+    std::atomic<uint64_t> statHits{0};
+    std::atomic<uint64_t> statMisses{0};
+    std::atomic<uint64_t> readHits{0};
+    std::atomic<uint64_t> readMisses{0};
+
+    std::optional<llvm::vfs::Status> getStatus(StringRef path) {
+        Shard &shard = getShard(path);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.status.find(path);
+        if (it == shard.status.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    void setStatus(StringRef path, const llvm::vfs::Status &status) {
+        Shard &shard = getShard(path);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.status.try_emplace(path, status);
+    }
+
+    // True once the cached contents reach --file-cache-limit
+    bool isFull() const {
+        return bufferBytes >= (uint64_t)fileCacheLimit * 1024 * 1024;
+    }
+
+    const llvm::MemoryBuffer *getBuffer(StringRef path) {
+        Shard &shard = getShard(path);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.buffers.find(path);
+        return it == shard.buffers.end() ? nullptr : it->second.get();
+    }
+
+    // Returns the cached buffer for `path`, which is `buffer` unless another
+    // thread got there first.
+    const llvm::MemoryBuffer *setBuffer(StringRef path, std::unique_ptr<llvm::MemoryBuffer> buffer) {
+        Shard &shard = getShard(path);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const size_t size = buffer->getBufferSize();
+        auto inserted = shard.buffers.try_emplace(path, std::move(buffer));
+        if (inserted.second) {
+            bufferBytes += size;
+        }
+        return inserted.first->second.get();
+    }
+
+    // Drops everything. Only called between passes, when no tool is running.
+    void clear() {
+        for (Shard &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.status.clear();
+            shard.buffers.clear();
+        }
+        bufferBytes = 0;
+    }
+
+    private:
+    // Sharded by path so that threads opening different headers do not
+    // contend on one lock.
+    struct Shard {
+        std::mutex mutex;
+        llvm::StringMap<llvm::vfs::Status> status;
+        llvm::StringMap<std::unique_ptr<llvm::MemoryBuffer>> buffers;
+    };
+
+    std::atomic<uint64_t> bufferBytes{0};
+
+    Shard &getShard(StringRef path) {
+        return shards[llvm::hash_value(path) % NUM_SHARDS];
+    }
+
+    static constexpr size_t NUM_SHARDS = 64;
+    Shard shards[NUM_SHARDS];
+};
+
+static SharedFileCache file_cache;
+
+// A file served from SharedFileCache.
+class CachedFile : public llvm::vfs::File {
+    public:
+    CachedFile(llvm::vfs::Status status, const llvm::MemoryBuffer &buffer)
+    : S(std::move(status)), buffer(buffer) {}
+
+    virtual llvm::ErrorOr<llvm::vfs::Status> status() override {
+        return S;
+    }
+
+    virtual llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> getBuffer(
+            const Twine &Name, int64_t FileSize, bool RequiresNullTerminator,
+            bool IsVolatile) override {
+        // Cached buffers are always null-terminated
+        return llvm::MemoryBuffer::getMemBuffer(buffer.getBuffer(), Name.str(),
+                                                RequiresNullTerminator);
+    }
+
+    virtual std::error_code close() override {
+        return std::error_code();
+    }
+
+    private:
+    llvm::vfs::Status S;
+    const llvm::MemoryBuffer &buffer;
+};
+
+// Puts file_cache in front of a tool's file system. Each tool keeps its own
+// underlying file system for its working directory; paths are made
+// absolute before they are looked up in the shared cache.
+class CachingFileSystem : public llvm::vfs::ProxyFileSystem {
+    public:
+    CachingFileSystem(IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS)
+    : ProxyFileSystem(std::move(FS)) {}
+
+    virtual llvm::ErrorOr<llvm::vfs::Status> status(const Twine &Path) override {
+        SmallString<PATH_MAX> path;
+        if (!getAbsolutePath(Path, path)) {
+            return ProxyFileSystem::status(Path);
+        }
+
+        if (auto cached = file_cache.getStatus(path)) {
+            ++file_cache.statHits;
+            return llvm::vfs::Status::copyWithNewName(*cached, Path);
+        }
+
+        ++file_cache.statMisses;
+        auto status = ProxyFileSystem::status(path);
+        if (!status) {
+            return status;
+        }
+        file_cache.setStatus(path, *status);
+        return llvm::vfs::Status::copyWithNewName(*status, Path);
+    }
+
+    virtual llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead(const Twine &Path) override {
+        SmallString<PATH_MAX> path;
+        // Only headers are read by more than one TU
+        if (!getAbsolutePath(Path, path) || llvm::sys::path::extension(path) != ".h") {
+            return ProxyFileSystem::openFileForRead(Path);
+        }
+
+        const auto status = this->status(path);
+        if (!status) {
+            return status.getError();
+        }
+
+        const llvm::MemoryBuffer *buffer = file_cache.getBuffer(path);
+        if (buffer != nullptr) {
+            ++file_cache.readHits;
+        }
+        else if (file_cache.isFull()) {
+            ++file_cache.readMisses;
+            return ProxyFileSystem::openFileForRead(Path);
+        }
+        else {
+            ++file_cache.readMisses;
+            auto file = ProxyFileSystem::openFileForRead(path);
+            if (!file) {
+                return file.getError();
+            }
+            auto contents = (*file)->getBuffer(path, status->getSize(),
+                                               /*RequiresNullTerminator=*/true,
+                                               /*IsVolatile=*/false);
+            if (!contents) {
+                return contents.getError();
+            }
+            buffer = file_cache.setBuffer(path, std::move(*contents));
+        }
+        return std::make_unique<CachedFile>(
+            llvm::vfs::Status::copyWithNewName(*status, Path), *buffer);
+    }
+
+    private:
+    bool getAbsolutePath(const Twine &Path, SmallVectorImpl<char> &out) const {
+        Path.toVector(out);
+        if (makeAbsolute(out)) {
+            return false;
+        }
+        llvm::sys::path::remove_dots(out);
+        return true;
+    }
+};
+
+// Returns the file system for a tool running on its own thread. Every tool
+// gets its own physical file system, because the process-wide one changes
+// the working directory of the whole process.
+IntrusiveRefCntPtr<llvm::vfs::FileSystem> createToolFileSystem(bool threaded)
+{
+    auto FS = threaded ? llvm::vfs::createPhysicalFileSystem()
+                       : llvm::vfs::getRealFileSystem();
+    if (!fileCache) {
+        return FS;
+    }
+    return llvm::makeIntrusiveRefCnt<CachingFileSystem>(std::move(FS));
+}
+
+// ----------------------------------------------------------------------------
+// WORKER THREADS
+// ----------------------------------------------------------------------------
+
+unsigned getNumThreads(size_t items)
+{
+    return std::max(1u, std::min<unsigned>(
+        jobs ? jobs.getValue() : std::thread::hardware_concurrency(), items));
+}
+
+// Calls fn(i) for every i < n on --jobs threads, each thread taking the next
+// item, and merges the per-thread totals once a thread is done.
+void parallelFor(size_t n, const std::function<void(size_t)> &fn)
+{
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+
+    for (unsigned t = 0; t < getNumThreads(n); ++t) {
+        threads.emplace_back([&]() {
+            for (size_t i = next++; i < n; i = next++) {
+                fn(i);
+            }
+            mergeThreadTotals();
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+// Runs `factory` on a single file, on any thread.
+int runOnFile(const CompilationDatabase &compilations, const std::string &file,
+              FrontendActionFactory *factory)
+{
+    ClangTool Tool(compilations, file,
+                   std::make_shared<PCHContainerOperations>(),
+                   createToolFileSystem(/*threaded=*/true));
+    WarningDiagConsumer diagConsumer;
+    Tool.setDiagnosticConsumer(&diagConsumer);
+    addDiagnosticAdjusters(Tool);
+    return Tool.run(factory);
+}
+
+// ----------------------------------------------------------------------------
+// LEXER ENGINE
+// ----------------------------------------------------------------------------
+
+// Estimates the counts without parsing. Every source file and every header
+// it includes is run once through the raw lexer, and a small state machine
+// recognises tracked fields (`atomic_t name;`, `struct kref name;`) in
+// struct bodies. Nothing is preprocessed, so fields under any #ifdef branch
+// are counted, macro-generated fields are missed, and includes are resolved
+// against the union of the -I paths of the database.
+class LexerEstimator {
+    public:
+    LexerEstimator(const CompilationDatabase &compilations) {
+        for (size_t i = 0; i < registry.types.size(); ++i) {
+            const TrackedType &type = registry.types[i];
+            (type.kind == TrackedType::TYPEDEF ? typedefs : records)[type.name] = i;
+        }
+        for (const std::string &name : registry.excluded) {
+            excluded.insert(name);
+        }
+
+        llvm::StringSet<> seen;
+        for (const CompileCommand &cmd : compilations.getAllCompileCommands()) {
+            const auto &args = cmd.CommandLine;
+            for (size_t i = 0; i < args.size(); ++i) {
+                StringRef arg = args[i];
+                StringRef dir;
+                for (StringRef flag : {"-I", "-isystem", "-iquote"}) {
+                    if (arg == flag && i + 1 < args.size()) {
+                        dir = args[++i];
+                        break;
+                    }
+                    if (arg.starts_with(flag)) {
+                        dir = arg.drop_front(flag.size());
+                        break;
+                    }
+                }
+                if (dir.empty()) {
+                    continue;
+                }
+                SmallString<PATH_MAX> path(dir);
+                llvm::sys::fs::make_absolute(cmd.Directory, path);
+                llvm::sys::path::remove_dots(path, /*remove_dot_dot=*/true);
+                if (seen.insert(path).second) {
+                    searchDirs.push_back(path.str().str());
+                }
+            }
+        }
+    }
+
+    // Lexes `files` and everything they include, each file once, and returns
+    // the counts of every file with tracked fields.
+    std::vector<std::pair<std::string, Refcnt>> run(const std::vector<std::string> &files) {
+        std::vector<std::pair<std::string, Refcnt>> ret;
+        llvm::StringSet<> visited;
+        std::vector<std::string> round;
+
+        for (const std::string &file : files) {
+            if (visited.insert(file).second) {
+                round.push_back(file);
+            }
+        }
+
+        // Breadth first over the include graph: each round lexes the files
+        // found by the previous one in parallel.
+        while (!round.empty()) {
+            std::vector<FileResult> results(round.size());
+            parallelFor(round.size(), [&](size_t i) {
+                lexFile(round[i], results[i]);
+            });
+
+            std::vector<std::string> next;
+            for (size_t i = 0; i < round.size(); ++i) {
+                for (const auto &include : results[i].includes) {
+                    const std::string *path = resolve(round[i], include.first, include.second);
+                    if (path != nullptr && visited.insert(*path).second) {
+                        next.push_back(*path);
+                    }
+                }
+                if (results[i].tracked) {
+                    ret.emplace_back(std::move(round[i]), std::move(results[i].counts));
+                }
+            }
+            round = std::move(next);
+        }
+        return ret;
+    }
+
+    private:
+    struct FileResult {
+        Refcnt counts;
+        bool tracked = false;
+        std::vector<std::pair<std::string, bool>> includes;    // name, angled
+    };
+
+    // States of the field recogniser, reset at every ';'.
+    enum State {
+        MEMBER_START,   // at the start of a declaration
+        STRUCT_KEYWORD, // after struct/union
+        STRUCT_NAME,    // after struct/union <name>
+        TRACKED_TYPE,   // after a tracked type, expecting the field name
+        DECLARATOR,     // after the field name, not yet counted
+        SKIP            // in anything else, until the next ';'
+    };
+
+    void lexFile(const std::string &path, FileResult &result) const {
+        auto buffer = llvm::MemoryBuffer::getFile(path);
+        if (!buffer) {
+            return;
+        }
+
+        static const LangOptions langOpts;
+        const char *start = (*buffer)->getBufferStart();
+        Lexer lexer(SourceLocation(), langOpts, start, start, (*buffer)->getBufferEnd());
+
+        // One entry per open brace: whether it is a struct body and whether
+        // it is (inside) an excluded record.
+        struct Scope {
+            bool isStruct;
+            bool excluded;
+        };
+        SmallVector<Scope, 16> scopes;
+        State state = MEMBER_START;
+        StringRef structName;
+        int type = -1;
+        bool inDirective = false;
+
+        auto count = [&]() {
+            if (!scopes.empty() && scopes.back().isStruct && !scopes.back().excluded) {
+                ++result.counts.cnt[type];
+                result.tracked = true;
+            }
+        };
+
+        Token tok;
+        while (true) {
+            lexer.LexFromRawLexer(tok);
+            if (tok.is(tok::eof)) {
+                break;
+            }
+
+            // Preprocessor directives are skipped to the end of their
+            // (logical) line; only the names of includes are kept.
+            if (tok.isAtStartOfLine()) {
+                inDirective = false;
+                if (tok.is(tok::hash)) {
+                    inDirective = true;
+                    lexer.LexFromRawLexer(tok);
+                    if (tok.is(tok::raw_identifier) && tok.getRawIdentifier() == "include") {
+                        addInclude(lexer.getBufferLocation(), (*buffer)->getBufferEnd(), result);
+                    }
+                    continue;
+                }
+            }
+            if (inDirective) {
+                continue;
+            }
+
+            switch (tok.getKind()) {
+            case tok::l_brace: {
+                const bool isStruct = state == STRUCT_KEYWORD || state == STRUCT_NAME;
+                const bool parentExcluded = !scopes.empty() && scopes.back().excluded;
+                scopes.push_back({isStruct, parentExcluded ||
+                                  (state == STRUCT_NAME && excluded.contains(structName))});
+                state = MEMBER_START;
+                break;
+            }
+            case tok::r_brace:
+                if (!scopes.empty()) {
+                    scopes.pop_back();
+                }
+                state = SKIP;
+                break;
+            case tok::semi:
+                if (state == DECLARATOR) {
+                    count();
+                }
+                state = MEMBER_START;
+                break;
+            case tok::comma:
+                if (state == DECLARATOR) {
+                    count();
+                    state = TRACKED_TYPE;
+                }
+                break;
+            case tok::raw_identifier: {
+                const StringRef ident = tok.getRawIdentifier();
+                if (ident == "const" || ident == "volatile") {
+                    break;
+                }
+                if (ident == "struct" || ident == "union") {
+                    state = STRUCT_KEYWORD;
+                    break;
+                }
+                switch (state) {
+                case MEMBER_START: {
+                    auto it = typedefs.find(ident);
+                    if (it != typedefs.end()) {
+                        type = it->second;
+                        state = TRACKED_TYPE;
+                    }
+                    else {
+                        state = SKIP;
+                    }
+                    break;
+                }
+                case STRUCT_KEYWORD:
+                    structName = ident;
+                    state = STRUCT_NAME;
+                    break;
+                case STRUCT_NAME: {
+                    auto it = records.find(structName);
+                    if (it != records.end()) {
+                        type = it->second;
+                        state = DECLARATOR;
+                    }
+                    else {
+                        state = SKIP;
+                    }
+                    break;
+                }
+                case TRACKED_TYPE:
+                    state = DECLARATOR;
+                    break;
+                case DECLARATOR:
+                    // Attributes such as ____cacheline_aligned
+                    count();
+                    state = SKIP;
+                    break;
+                default:
+                    break;
+                }
+                break;
+            }
+            default:
+                // Pointers, arrays and functions do not have a tracked type
+                if (state != MEMBER_START) {
+                    state = SKIP;
+                }
+                break;
+            }
+        }
+    }
+
+    // Reads the name of an include from the rest of the directive line.
+    static void addInclude(const char *p, const char *end, FileResult &result) {
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            ++p;
+        }
+        if (p == end || (*p != '"' && *p != '<')) {
+            return;
+        }
+        const bool angled = *p == '<';
+        const char close = angled ? '>' : '"';
+        const char *name = ++p;
+        while (p < end && *p != close && *p != '\n') {
+            ++p;
+        }
+        if (p < end && *p == close) {
+            result.includes.emplace_back(std::string(name, p), angled);
+        }
+    }
+
+    // Finds an included file the way the compiler would, minus the
+    // per-TU search path. Returns nullptr if it cannot be found.
+    const std::string *resolve(StringRef includer, StringRef name, bool angled) {
+        SmallString<PATH_MAX> key;
+        if (!angled) {
+            key = llvm::sys::path::parent_path(includer);
+        }
+        key += '\0';
+        key += name;
+
+        auto inserted = resolved.try_emplace(key);
+        if (!inserted.second) {
+            return inserted.first->second ? &*inserted.first->second : nullptr;
+        }
+
+        auto tryDir = [&](StringRef dir) {
+            SmallString<PATH_MAX> path(dir);
+            llvm::sys::path::append(path, name);
+            llvm::sys::path::remove_dots(path, /*remove_dot_dot=*/true);
+            if (llvm::sys::fs::is_regular_file(path)) {
+                inserted.first->second = path.str().str();
+                return true;
+            }
+            return false;
+        };
+
+        if (!angled && tryDir(llvm::sys::path::parent_path(includer))) {
+            return &*inserted.first->second;
+        }
+        for (const std::string &dir : searchDirs) {
+            if (tryDir(dir)) {
+                return &*inserted.first->second;
+            }
+        }
+        return nullptr;
+    }
+
+    llvm::StringMap<int> typedefs;
+    llvm::StringMap<int> records;
+    llvm::StringSet<> excluded;
+    std::vector<std::string> searchDirs;
+    llvm::StringMap<std::optional<std::string>> resolved;
+};
+
+// ----------------------------------------------------------------------------
+// SAMPLING
+// ----------------------------------------------------------------------------
+
+// Estimates the totals of the whole tree from a stratified random sample of
+// its TUs, one stratum per top-level directory.
+//
+// Headers are deduplicated as in a full run: each header reached by the
+// sample counts once, unscaled, since the shared headers are reached by
+// almost any sample. The fields of the sampled source files themselves are
+// scaled up per stratum, and the confidence interval comes from their
+// variance. Headers only included by TUs outside the sample are missing
+// from the estimate.
+class SampleEstimate {
+    public:
+    // Picks about `fraction` of the TUs of every stratum, at least two so
+    // that the variance can be estimated. Returns their ordinals.
+    std::vector<unsigned> draw(const CompilationDatabase &compilations,
+                               const std::vector<std::string> &files,
+                               double fraction, unsigned seed) {
+        std::map<std::string, std::vector<unsigned>> byDir;
+        for (unsigned i = 0; i < files.size(); ++i) {
+            StringRef path = files[i];
+            const auto commands = compilations.getCompileCommands(files[i]);
+            if (!commands.empty() && path.consume_front(commands[0].Directory)) {
+                path = path.ltrim('/');
+            }
+            const auto split = path.split('/');
+            byDir[split.second.empty() ? "" : split.first.str()].push_back(i);
+        }
+
+        std::mt19937_64 rng(seed);
+        std::vector<unsigned> ret;
+        for (auto &entry : byDir) {
+            std::vector<unsigned> &members = entry.second;
+            const size_t n = std::min<size_t>(members.size(),
+                std::max<long long>(2, std::llround(fraction * members.size())));
+            std::shuffle(members.begin(), members.end(), rng);
+
+            Stratum stratum;
+            stratum.population = members.size();
+            for (size_t i = 0; i < n; ++i) {
+                stratum.index[members[i]] = i;
+                ret.push_back(members[i]);
+            }
+            stratum.own.resize(n);
+            strata.push_back(std::move(stratum));
+        }
+        std::sort(ret.begin(), ret.end());
+        return ret;
+    }
+
+    // Where the analysis of TU `ordinal` puts the counts of its source file
+    Refcnt *getOwnCounts(unsigned ordinal) {
+        for (Stratum &stratum : strata) {
+            auto it = stratum.index.find(ordinal);
+            if (it != stratum.index.end()) {
+                return &stratum.own[it->second];
+            }
+        }
+        return nullptr;
+    }
+
+    // Prints the estimates, given the deduplicated totals of the sample.
+    template <typename OStream>
+    void print(OStream &os, const Refcnt &observed) const {
+        size_t population = 0, sampled = 0;
+        for (const Stratum &stratum : strata) {
+            population += stratum.population;
+            sampled += stratum.own.size();
+        }
+        os << "\nestimated from " << sampled << " of " << population
+           << " translation units in " << strata.size() << " strata (95% CI):\n";
+
+        for (size_t t = 0; t < registry.types.size(); ++t) {
+            double estimate = observed.get(t);
+            double variance = 0;
+            for (const Stratum &stratum : strata) {
+                const double N = stratum.population;
+                const double n = stratum.own.size();
+                double sum = 0;
+                for (const Refcnt &own : stratum.own) {
+                    sum += own.get(t);
+                }
+                const double mean = sum / n;
+                // The sampled source files are in `observed` already
+                estimate += N * mean - sum;
+                if (n > 1) {
+                    double squares = 0;
+                    for (const Refcnt &own : stratum.own) {
+                        squares += (own.get(t) - mean) * (own.get(t) - mean);
+                    }
+                    variance += N * N * (1 - n / N) * (squares / (n - 1)) / n;
+                }
+            }
+            os << registry.types[t].label << ": " << std::llround(estimate)
+               << " +- " << std::llround(1.96 * std::sqrt(variance)) << "\n";
+        }
+    }
+
+    private:
+    struct Stratum {
+        size_t population = 0;
+        std::map<unsigned, unsigned> index;     // TU ordinal -> position in own
+        std::vector<Refcnt> own;                // counts in each sampled source file
+    };
+
+    std::vector<Stratum> strata;
+};
+
+static SampleEstimate sample_estimate;
+
+// ----------------------------------------------------------------------------
+// CHANGED FILES
+// ----------------------------------------------------------------------------
+
+// Runs a shell command and returns its standard output, or std::nullopt if
+// it could not be run or exited with an error.
+std::optional<std::string> readCommand(const std::string &command)
+{
+    FILE *pipe = popen(command.c_str(), "r");
+    if (pipe == nullptr) {
+        return std::nullopt;
+    }
+
+    std::string output;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), pipe)) > 0) {
+        output.append(buf, n);
+    }
+    if (pclose(pipe) != 0) {
+        return std::nullopt;
+    }
+    return output;
+}
+
+std::string shellQuote(StringRef arg)
+{
+    std::string ret = "'";
+    for (char c : arg) {
+        if (c == '\'') {
+            ret += "'\\''";
+        }
+        else {
+            ret += c;
+        }
+    }
+    return ret + "'";
+}
+
+// Returns the absolute paths of the files changed in the git revision
+// range `range` (anything `git diff` accepts) of the repository we run in.
+bool getChangedFiles(StringRef range, std::vector<std::string> &changed, std::string &err)
+{
+    const auto top = readCommand("git rev-parse --show-toplevel");
+    if (!top) {
+        err = "not inside a git repository";
+        return false;
+    }
+
+    const auto diff = readCommand("git diff --name-only " + shellQuote(range));
+    if (!diff) {
+        err = "git diff " + range.str() + " failed";
+        return false;
+    }
+
+    SmallVector<StringRef, 64> lines;
+    StringRef(*diff).split(lines, '\n', -1, /*KeepEmpty=*/false);
+    for (StringRef line : lines) {
+        SmallString<PATH_MAX> path(StringRef(*top).trim());
+        llvm::sys::path::append(path, line);
+        changed.push_back(path.str().str());
+    }
+    return true;
+}
+
+// Resolves symlinks, so that the paths of git, the compile database and the
+// include index compare equal whatever route they were spelled through. A
+// path that does not exist (a deleted file) is only cleaned up.
+std::string getRealPath(StringRef path)
+{
+    SmallString<PATH_MAX> ret;
+    if (llvm::sys::fs::real_path(path, ret)) {
+        ret = path;
+        llvm::sys::path::remove_dots(ret, /*remove_dot_dot=*/true);
+    }
+    return ret.str().str();
+}
+
+// Returns the translation units of `compilations` affected by `changed`:
+// changed TUs themselves and every TU including a changed header, as
+// spelled in the database.
+std::vector<std::string> getAffectedTUs(const CompilationDatabase &compilations,
+        const std::vector<std::string> &changed, const IncludeIndex *index)
+{
+    llvm::StringMap<std::string> known;     // real path -> database path
+    llvm::StringSet<> affected;
+    std::vector<std::string> ret;
+
+    for (const std::string &file : compilations.getAllFiles()) {
+        known.try_emplace(getRealPath(file), file);
+    }
+
+    auto add = [&](StringRef tu) {
+        auto it = known.find(getRealPath(tu));
+        if (it != known.end() && affected.insert(it->first()).second) {
+            ret.push_back(it->second);
+        }
+    };
+
+    for (const std::string &file : changed) {
+        const std::string real = getRealPath(file);
+        if (known.count(real)) {
+            add(real);
+            continue;
+        }
+        if (index != nullptr) {
+            // The index has the paths the compiler opened, which may go
+            // through a symlink git does not
+            for (StringRef tu : index->lookup(file)) {
+                add(tu);
+            }
+            if (real != file) {
+                for (StringRef tu : index->lookup(real)) {
+                    add(tu);
+                }
+            }
+        }
+        else if (llvm::sys::path::extension(file) == ".h") {
+            llvm::errs() << "Warning: header '" << file << "' changed, but without "
+                         << "--include-index the TUs including it are not analysed\n";
+        }
+    }
+    return ret;
+}
+
+// ----------------------------------------------------------------------------
+// CONFIGURATIONS
+// ----------------------------------------------------------------------------
+
+// One compilation database given with --compile-db, e.g. one kernel config.
+struct BuildConfig {
+    std::string name;
+    std::unique_ptr<CompilationDatabase> database;
+    std::vector<std::string> files;
+    std::vector<unsigned> units;        // per file, index into the unique TUs
+    Refcnt totals;
+};
+
+// A translation unit as seen after preprocessing. Identical TUs of
+// different configs are analysed once, through the first config that has
+// them, and their per-file counts are attributed to every config.
+struct UniqueTU {
+    unsigned config;
+    unsigned file;
+    llvm::StringMap<Refcnt> counts;     // every file the TU reaches
+};
+
+// Preprocesses a TU and hashes the resulting token stream together with the
+// target and the files the tokens come from. Two TUs with the same hash
+// produce the same matches in the same files.
+class FingerprintAction : public PreprocessorFrontendAction {
+    public:
+    FingerprintAction(std::optional<llvm::MD5::MD5Result> &result) : result(result) {}
+
+    protected:
+    virtual void ExecuteAction() override {
+        CompilerInstance &CI = getCompilerInstance();
+        Preprocessor &PP = CI.getPreprocessor();
+        const SourceManager &SM = PP.getSourceManager();
 
-        if (node == nullptr) {
-            return;
-        }
-        
-        const auto &SM = *Result.SourceManager;
-        const auto &loc = node->getBeginLoc();
-        const auto &srcFile = SM.getFilename(SM.getSpellingLoc(loc)).str();
-        std::string logFile;
+        llvm::MD5 hash;
+        hash.update(CI.getTargetOpts().Triple);
 
-        if (srcFile.empty()) {
-            llvm::errs() << "Path empty!\n";
-            return;
-        }
-        logFile = LOG_DIR + srcFile;
-        // llvm::outs() << "srcFile: " << srcFile << "\n";
-        // llvm::outs() << "logFile: " << logFile << "\n";
+        FileID lastFile;
+        Token tok;
+        PP.EnterMainSourceFile();
+        for (PP.Lex(tok); tok.isNot(tok::eof); PP.Lex(tok)) {
+            const FileID fid = SM.getFileID(SM.getExpansionLoc(tok.getLocation()));
+            if (fid != lastFile) {
+                lastFile = fid;
+                if (auto FE = SM.getFileEntryRefForID(fid)) {
+                    hash.update(FE->getName());
+                }
+                hash.update(ArrayRef<uint8_t>{0});
+            }
 
-        if (access(logFile.c_str(), F_OK) == 0) {
-            return;
+            const uint16_t kind = tok.getKind();
+            hash.update(ArrayRef<uint8_t>(reinterpret_cast<const uint8_t *>(&kind), sizeof(kind)));
+            if (const IdentifierInfo *II = tok.getIdentifierInfo()) {
+                hash.update(II->getName());
+            }
+            else if (tok.isLiteral() && tok.getLiteralData() != nullptr) {
+                hash.update(StringRef(tok.getLiteralData(), tok.getLength()));
+            }
         }
+        result = hash.final();
+    }
 
-        auto &pair = files.insert({logFile, std::pair<std::stringstream, Refcnt>()}).first->second;
-        const std::string &type = node->getType().getAsString();
-        
-        if (type == "atomic_t") {
-            ++pair.second.atomic_t_cnt;
-        } else if (type == "atomic_long_t") {
-            ++pair.second.atomic_long_t_cnt;
-        } else if (type == "atomic64_t") {
-            ++pair.second.atomic64_t_cnt;
-        } else if (type == "refcount_t") {
-            ++pair.second.refcount_t_cnt;
-        } else if (type == "struct kref") {
-            ++pair.second.kref_cnt;
-        }
+    private:
+    std::optional<llvm::MD5::MD5Result> &result;
+};
 
-        std::string rowcol = std::to_string(SM.getExpansionLineNumber(loc)) + ":" + std::to_string(SM.getExpansionColumnNumber(loc));
+class FingerprintActionFactory : public FrontendActionFactory {
+    public:
+    FingerprintActionFactory(std::optional<llvm::MD5::MD5Result> &result) : result(result) {}
 
-        pair.first << std::left << std::setw(10) << rowcol
-                   << "Name: " << std::setw(20) << node->getName().str()
-                   << "Type: " << node->getType().getAsString() << "\n";
+    virtual std::unique_ptr<FrontendAction> create() override {
+        return std::make_unique<FingerprintAction>(result);
     }
-};
-
-// class IncludeRewriteCallback : public clang::PPCallbacks {
-//     public:
-//     virtual void InclusionDirective(
-//         SourceLocation HashLoc,
-//         const Token &IncludeTok, StringRef FileName,
-//         bool IsAngled, CharSourceRange FilenameRange,
-//         OptionalFileEntryRef File,
-//         StringRef SearchPath, StringRef RelativePath,
-//         const Module *SuggestedModule,
-//         bool ModuleImported,
-//         SrcMgr::CharacteristicKind FileType) override {
-        
-//     }
 
-//     private:
-//     Rewriter rewriter;
-//     const SourceManager &SM;
-// };
+    private:
+    std::optional<llvm::MD5::MD5Result> &result;
+};
 
 // ----------------------------------------------------------------------------
-// REGISTERING CALLBACKS
+// OUR PROGRAM
 // ----------------------------------------------------------------------------
 
-// The ASTConsumer allows us to dictate:
-//      - which AST nodes we match, and
-//      - how we want to handle those matched nodes
-class RefcntASTConsumer : public ASTConsumer {
+// Checks if the given filepath can be accessed without issue.
+// Returns true if it is accessible, else returns false.
+bool filepathAccessible(std::string path)
+{   
+    std::ifstream file(path);
+    return file.is_open();
+}
 
-    public:
-    RefcntASTConsumer(clang::Preprocessor& PP) {
-    
-        // Here we add all of the checks that should be run
-        // when the AST is traversed by using Matcher.addMatcher
+// Parses --shard=i/N.
+bool parseShard(unsigned &index, unsigned &count)
+{
+    const auto split = StringRef(shard).split('/');
+    return !split.first.getAsInteger(10, index) && !split.second.getAsInteger(10, count)
+           && index < count;
+}
 
-        // At the moment, there are no checks registered
+// Splits `files` into `count` shards of about equal estimated cost and
+// returns the ordinals of shard `index`, in database order. Every shard
+// process computes the same split from the same database.
+std::vector<unsigned> getShard(const std::vector<std::string> &files, unsigned index, unsigned count)
+{
+    // Source size is a rough proxy for parse time. Every TU also pays for
+    // the headers it includes, which is about the same for all of them.
+    constexpr uint64_t HEADER_COST = 64 * 1024;
+    std::vector<std::pair<uint64_t, unsigned>> costs;
+    for (unsigned i = 0; i < files.size(); ++i) {
+        uint64_t size = 0;
+        llvm::sys::fs::file_size(files[i], size);
+        costs.emplace_back(size + HEADER_COST, i);
+    }
+    std::sort(costs.begin(), costs.end(), [](const auto &a, const auto &b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
 
-        // PP.addPPCallbacks(std::make_unique<clang::PPCallbacks>());
+    // Longest processing time first: each TU goes to the least loaded shard
+    std::vector<uint64_t> load(count, 0);
+    std::vector<unsigned> ret;
+    for (const auto &cost : costs) {
+        const size_t target = std::min_element(load.begin(), load.end()) - load.begin();
+        load[target] += cost.first;
+        if (target == index) {
+            ret.push_back(cost.second);
+        }
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
 
-        auto *callback = new TypeCheck;
+// Totals of the lexer estimate when it runs next to a parsing engine.
+static Refcnt lexer_estimate;
 
-        Matcher.addMatcher(
-            fieldDecl(
-                anyOf(
-                    hasType(typedefNameDecl(hasAnyName(
-                        "atomic_t",
-                        "atomic_long_t",
-                        "atomic64_t",
-                        "refcount_t"
-                    ))),
-                    hasType(recordDecl(hasName("kref")))
-                ),
-                unless(hasAncestor(recordDecl(hasAnyName(
-                    "kref",
-                    "refcount_t"
-                ))))
-            ).bind("refcntType"),
-            callback
-        );
-        // Matcher.addMatcher(
-        //     declaratorDecl(
-        //         matchesName(".*ref.*"),
-        //         unless(anyOf(
-        //             hasType(typedefNameDecl(hasAnyName(
-        //                 "atomic_t",
-        //                 "atomic_long_t",
-        //                 "atomic64_t",
-        //                 "refcount_t"
-        //             ))),
-        //             hasType(recordDecl(hasName("kref")))
-        //         )),
-        //         anyOf(
-        //             varDecl(),
-        //             fieldDecl()
-        //         )
-        //     ).bind("refcntName"),
-        //     callback
-        // );
+// Runs the analysis over `files`, accumulating into run_totals.
+void analyse(const CompilationDatabase &compilations, const std::vector<std::string> &files)
+{
+    if (engine == Engine::LEXER || lexerCompare) {
+        LexerEstimator estimator(compilations);
+        for (const auto &file : estimator.run(files)) {
+            if (engine == Engine::LEXER) {
+                total_refcnt += file.second;
+                aggregates.addFile(file.first, file.second);
+            }
+            else {
+                lexer_estimate += file.second;
+            }
+        }
+        if (engine == Engine::LEXER) {
+            mergeThreadTotals();
+            return;
+        }
     }
 
-    void HandleTranslationUnit(ASTContext& Context) override {
-        Matcher.matchAST(Context);
+    // The result store and sampling need to know which TU each match comes
+    // from, so they always run one tool per file.
+    if (getNumThreads(files.size()) == 1 && resultStore.empty() && sampleFraction == 0) {
+        ClangTool Tool(compilations, files,
+                       std::make_shared<PCHContainerOperations>(),
+                       createToolFileSystem(/*threaded=*/false));
+        WarningDiagConsumer diagConsumer;
+        Tool.setDiagnosticConsumer(&diagConsumer);
+        addDiagnosticAdjusters(Tool);
+        progress.start(files.size());
+        Tool.run(newFrontendActionFactory<RefcntFrontEndAction>().get());
+        progress.stop();
+        file_cache.clear();
+        mergeThreadTotals();
+        return;
     }
 
-    private:
-    MatchFinder Matcher;
-};
+    std::vector<unsigned> ordinals(files.size());
+    std::iota(ordinals.begin(), ordinals.end(), 0);
+    unsigned index, count;
+    if (!shard.empty() && parseShard(index, count)) {
+        ordinals = getShard(files, index, count);
+        llvm::errs() << "shard " << index << "/" << count << ": "
+                     << ordinals.size() << " of " << files.size() << " translation units\n";
+    }
+    else if (sampleFraction > 0) {
+        ordinals = sample_estimate.draw(compilations, files, sampleFraction, sampleSeed);
+    }
 
-// The FrontEndAction is the main entry point for the clang tooling library
-// and allows us to add callbacks via:
-//      PPCallback classes  - for callbacks involving the preprocessor
-//      ASTConsumer classes - for callbacks involving AST nodes 
-class RefcntFrontEndAction : public ASTFrontendAction {
+    progress.start(ordinals.size());
+    parallelFor(ordinals.size(), [&](size_t i) {
+        tu_ordinal = ordinals[i];
+        tu_main_counts = sampleFraction > 0 ? sample_estimate.getOwnCounts(ordinals[i]) : nullptr;
+        runOnFile(compilations, files[ordinals[i]],
+                  newFrontendActionFactory<RefcntFrontEndAction>().get());
+    });
+    progress.stop();
+    file_cache.clear();
+}
 
-    public:
-    virtual bool BeginSourceFileAction(CompilerInstance &CI) override {
-        const auto &SM = CI.getSourceManager();
-        
-        // const std::string &filePath = SM.getFileEntryForID(SM.getMainFileID())->tryGetRealPathName().str();
+bool loadTypeConfig()
+{
+    if (typeConfig.empty()) {
+        return true;
+    }
+    std::string err;
+    if (!registry.loadFromFile(typeConfig, err)) {
+        llvm::errs() << "Error: " << err << "\n";
+        return false;
+    }
+    return true;
+}
 
-        // llvm::outs() << "File path: " << filePath << "\n";
+// `refcnt merge [options] <store>...` combines the result stores of shard
+// runs into the logs and totals a single run would have written. Options
+// have to be given in their --name=value form.
+bool mergeStores(int argc, const char **argv)
+{
+    std::vector<const char *> args = {argv[0]};
+    std::vector<std::string> stores;
+    for (int i = 2; i < argc; ++i) {
+        if (argv[i][0] == '-') {
+            args.push_back(argv[i]);
+        }
+        else {
+            stores.push_back(argv[i]);
+        }
+    }
+    if (!cl::ParseCommandLineOptions(args.size(), args.data(), "", &llvm::errs())) {
+        return false;
+    }
+    if (!loadTypeConfig()) {
+        return false;
+    }
+    if (stores.empty()) {
+        llvm::errs() << "Error: No result stores specified\n";
+        return false;
+    }
 
-        return true;
+    for (const std::string &path : stores) {
+        std::string err;
+        if (!result_store.read(path, err)) {
+            llvm::errs() << "Error: " << err << "\n";
+            return false;
+        }
     }
+    result_store.emit();
+    return true;
+}
 
-    virtual std::unique_ptr<ASTConsumer> CreateASTConsumer(
-            CompilerInstance& CI, StringRef file) override {
+// `refcnt diff <store A> <store B>` prints the fields added, removed or
+// changed in type from A to B, e.g. between two kernel releases.
+bool diffStores(int argc, const char **argv)
+{
+    if (argc != 4) {
+        llvm::errs() << "Usage: " << argv[0] << " diff <store A> <store B>\n";
+        return false;
+    }
+    StoreCursor A, B;
+    std::string err;
+    if (!A.open(argv[2], err) || !B.open(argv[3], err) ||
+            !diffFields(llvm::outs(), A, B, err)) {
+        llvm::errs() << "Error: " << err << "\n";
+        return false;
+    }
+    return true;
+}
 
-        // Here we add any checks which require the preprocessor.
-        // At the moment, there are no checks registered
+// Analyses the TUs of every --compile-db config, each distinct preprocessed
+// TU once, and prints the totals of each config after the overall ones.
+// The logs and overall totals are deduplicated across all configs.
+bool analyseConfigs(std::vector<BuildConfig> &configs)
+{
+    if (engine == Engine::LEXER) {
+        llvm::errs() << "Error: --compile-db needs a parsing engine\n";
+        return false;
+    }
 
-        return std::unique_ptr<ASTConsumer>(
-                new RefcntASTConsumer(CI.getPreprocessor()));
+    for (const std::string &arg : compileDbs) {
+        BuildConfig config;
+        const auto split = StringRef(arg).split('=');
+        const StringRef path = split.second.empty() ? split.first : split.second;
+        config.name = split.first.str();
+
+        std::string err;
+        config.database = JSONCompilationDatabase::loadFromFile(path, err, JSONCommandLineSyntax::AutoDetect);
+        if (!config.database) {
+            llvm::errs() << "Unable to load '" << path << "': " << err << "\n";
+            return false;
+        }
+        config.files = config.database->getAllFiles();
+        config.units.resize(config.files.size());
+        configs.push_back(std::move(config));
     }
 
-    virtual void EndSourceFileAction() override {
-        
+    // Fingerprint every (config, file) pair. Preprocessing is a fraction of
+    // a full parse, and most TUs are shared between configs.
+    std::vector<std::pair<unsigned, unsigned>> jobsList;
+    for (unsigned c = 0; c < configs.size(); ++c) {
+        for (unsigned f = 0; f < configs[c].files.size(); ++f) {
+            jobsList.emplace_back(c, f);
+        }
     }
+    std::vector<std::optional<llvm::MD5::MD5Result>> hashes(jobsList.size());
+    parallelFor(jobsList.size(), [&](size_t i) {
+        const BuildConfig &config = configs[jobsList[i].first];
+        FingerprintActionFactory factory(hashes[i]);
+        if (runOnFile(*config.database, config.files[jobsList[i].second], &factory) != 0) {
+            hashes[i].reset();
+        }
+    });
 
-    // virtual bool ParseArgs(
-    //     const CompilerInstance &CI,
-    //     const std::vector<std::string> &Args
-    // ) override {
-    //     return true;
-    // }
-};
+    // TUs that failed to preprocess are never shared, so their errors are
+    // reported for every config.
+    std::vector<UniqueTU> units;
+    std::map<std::pair<uint64_t, uint64_t>, unsigned> unitIndex;
+    for (size_t i = 0; i < jobsList.size(); ++i) {
+        const auto [c, f] = jobsList[i];
+        unsigned unit = units.size();
+        if (hashes[i]) {
+            unit = unitIndex.try_emplace(hashes[i]->words(), unit).first->second;
+        }
+        if (unit == units.size()) {
+            units.push_back({c, f, {}});
+        }
+        configs[c].units[f] = unit;
+    }
+    llvm::errs() << jobsList.size() << " translation units in " << configs.size()
+                 << " configs, " << units.size() << " distinct\n";
 
-// static FrontendPluginRegistry::Add<RefcntFrontEndAction> X("refcnt-plugin", "find refcnt");
+    progress.start(units.size());
+    parallelFor(units.size(), [&](size_t i) {
+        const BuildConfig &config = configs[units[i].config];
+        tu_file_counts = &units[i].counts;
+        runOnFile(*config.database, config.files[units[i].file],
+                  newFrontendActionFactory<RefcntFrontEndAction>().get());
+        tu_file_counts = nullptr;
+    });
+    progress.stop();
+    // The fingerprint and analysis passes read the same headers
+    file_cache.clear();
 
-// ----------------------------------------------------------------------------
-// OUR PROGRAM
-// ----------------------------------------------------------------------------
+    // Within a config a file is counted through the first TU reaching it,
+    // which is the same header dedup the logs use.
+    for (BuildConfig &config : configs) {
+        llvm::StringSet<> seen;
+        for (unsigned unit : config.units) {
+            for (const auto &entry : units[unit].counts) {
+                if (seen.insert(entry.getKey()).second) {
+                    config.totals += entry.second;
+                }
+            }
+        }
+    }
+    return true;
+}
 
-// Checks if the given filepath can be accessed without issue.
-// Returns true if it is accessible, else returns false.
-bool filepathAccessible(std::string path)
-{   
-    std::ifstream file(path);
-    return file.is_open();
+std::unique_ptr<CompilationDatabase> loadDefaultDatabase()
+{
+    std::string err_msg;
+    auto database = clang::tooling::JSONCompilationDatabase::loadFromFile(COMPILE_DATABASE, err_msg, JSONCommandLineSyntax::AutoDetect);
+    if (!database) {
+        llvm::errs() << "Unable to load '" COMPILE_DATABASE "': " << err_msg << "\n";
+    }
+    return database;
+}
+
+// Loads the database of a --git-range run. CommonOptionsParser only loads
+// one for the source files it is given, and there are none, so this looks
+// in the build directory given with -p, or else in the current directory.
+std::unique_ptr<CompilationDatabase> loadGitRangeDatabase()
+{
+    std::string dir = ".";
+    auto &options = cl::getRegisteredOptions();
+    auto buildPath = options.find("p");
+    if (buildPath != options.end()) {
+        const std::string &value = static_cast<cl::opt<std::string> *>(buildPath->second)->getValue();
+        if (!value.empty()) {
+            dir = value;
+        }
+    }
+    std::string err_msg;
+    auto database = CompilationDatabase::autoDetectFromDirectory(dir, err_msg);
+    if (!database) {
+        llvm::errs() << "Unable to load a compilation database from '" << dir << "' "
+                     << "(use -p <build dir>): " << err_msg << "\n";
+    }
+    return database;
 }
 
 int main(int argc, const char** argv)
@@ -321,36 +3937,107 @@ int main(int argc, const char** argv)
     // check for the optional flags. Note that we also allow for
     // zero or more arguments to allow for more fine-grained error
     // checking
-    if (argc > 1) {
+    std::vector<BuildConfig> configs;
+    if (argc > 1 && StringRef(argv[1]) == "diff") {
+        return diffStores(argc, argv) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (argc > 1 && StringRef(argv[1]) == "merge") {
+        if (!mergeStores(argc, argv)) {
+            return EXIT_FAILURE;
+        }
+    }
+    else if (argc > 1) {
         auto OptionsParser = CommonOptionsParser::create(argc, argv, refcntCategory, cl::ZeroOrMore);
         if (auto err = OptionsParser.takeError()) {
             llvm::errs() << std::move(err);
             return EXIT_FAILURE;
         }
 
-        // Our program is meant to analyse source code, so if we didn't
-        // get any filepaths, we print an error message and exit
-        auto files = OptionsParser->getSourcePathList();
-        if (files.empty()) {
-            llvm::errs() << "Error: No input files specified\n";
+        if (!loadTypeConfig()) {
             return EXIT_FAILURE;
         }
 
-        // Also, if any of the filepaths we've received are invalid,
-        // we also print an error message and exit
-        for (auto path : files) {
-            if (!filepathAccessible(path)) {
-                llvm::errs() << "Unable to access file '" << path << "'\n";
+        if (!shard.empty()) {
+            unsigned index, count;
+            if (!parseShard(index, count)) {
+                llvm::errs() << "Error: --shard expects i/N with 0 <= i < N\n";
+                return EXIT_FAILURE;
+            }
+            if (resultStore.empty() || engine == Engine::LEXER || !compileDbs.empty()) {
+                llvm::errs() << "Error: --shard needs --result-store and a parsing engine, "
+                             << "and cannot be combined with --compile-db\n";
                 return EXIT_FAILURE;
             }
         }
-        ClangTool Tool(OptionsParser->getCompilations(), files);
-        Tool.setDiagnosticConsumer(new WarningDiagConsumer);
-        Tool.run(newFrontendActionFactory<RefcntFrontEndAction>().get());
+
+        if (sampleFraction < 0 || sampleFraction > 1) {
+            llvm::errs() << "Error: --sample expects a fraction between 0 and 1\n";
+            return EXIT_FAILURE;
+        }
+        if (sampleFraction > 0 && (!shard.empty() || !compileDbs.empty() || engine == Engine::LEXER)) {
+            llvm::errs() << "Error: --sample cannot be combined with --shard, "
+                         << "--compile-db or --engine=lexer\n";
+            return EXIT_FAILURE;
+        }
+
+        if (!compileDbs.empty()) {
+            if (!analyseConfigs(configs)) {
+                return EXIT_FAILURE;
+            }
+        }
+        // In pre-commit mode the files to check come from git, not from
+        // the command line, and are looked up in the database of -p
+        else if (!gitRange.empty()) {
+            std::string err;
+            std::vector<std::string> changed;
+            if (!getChangedFiles(gitRange, changed, err)) {
+                llvm::errs() << "Error: " << err << "\n";
+                return EXIT_FAILURE;
+            }
+
+            IncludeIndex index;
+            if (!includeIndex.empty() && !index.load(includeIndex, err)) {
+                llvm::errs() << "Error: " << err << "\n";
+                return EXIT_FAILURE;
+            }
+
+            auto database = loadGitRangeDatabase();
+            if (!database) {
+                return EXIT_FAILURE;
+            }
+            const auto files = getAffectedTUs(*database, changed,
+                                              includeIndex.empty() ? nullptr : &index);
+            llvm::errs() << changed.size() << " changed files, "
+                         << files.size() << " translation units to analyse\n";
+            if (!files.empty()) {
+                analyse(*database, files);
+            }
+        }
+        else {
+            // Our program is meant to analyse source code, so if we didn't
+            // get any filepaths, we print an error message and exit
+            auto files = OptionsParser->getSourcePathList();
+            if (files.empty()) {
+                llvm::errs() << "Error: No input files specified\n";
+                return EXIT_FAILURE;
+            }
+
+            // Also, if any of the filepaths we've received are invalid,
+            // we also print an error message and exit
+            for (auto path : files) {
+                if (!filepathAccessible(path)) {
+                    llvm::errs() << "Unable to access file '" << path << "'\n";
+                    return EXIT_FAILURE;
+                }
+            }
+            analyse(OptionsParser->getCompilations(), files);
+        }
     }
     else {
-        std::string err_msg;
-        auto database = clang::tooling::JSONCompilationDatabase::loadFromFile(COMPILE_DATABASE, err_msg, JSONCommandLineSyntax::AutoDetect);
+        auto database = loadDefaultDatabase();
+        if (!database) {
+            return EXIT_FAILURE;
+        }
         for (std::string& path : database->getAllFiles()) {
             if (!filepathAccessible(path)) {
                 llvm::errs() << "Unable to access file '" << path << "'\n";
@@ -358,18 +4045,104 @@ int main(int argc, const char** argv)
         }
 
         // Next, we create the tool which will perform all of the 
-        // code analysis. In the base code you are provided, this
-        // tool doesn't perform any analysis at all.
-        ClangTool Tool(*database, database->getAllFiles());
-        Tool.setDiagnosticConsumer(new WarningDiagConsumer);
-        Tool.run(newFrontendActionFactory<RefcntFrontEndAction>().get());
+        // code analysis.
+        analyse(*database, database->getAllFiles());
+    }
+    broken_tus.print(llvm::errs(), 20);
+
+    if (!resultStore.empty()) {
+        std::string err;
+        if (!result_store.write(resultStore, err)) {
+            llvm::errs() << "Error: " << err << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+    // A shard's results only mean something once merged
+    if (!shard.empty()) {
+        return EXIT_SUCCESS;
+    }
+
+    const Refcnt &totals = run_totals.refcnt;
+    const MatchStats &stats = run_totals.stats;
+    totals.print(llvm::outs());
+    for (const BuildConfig &config : configs) {
+        llvm::outs() << "\n[" << config.name << "]\n";
+        config.totals.print(llvm::outs());
+    }
+    if (sampleFraction > 0) {
+        sample_estimate.print(llvm::outs(), totals);
+    }
+
+    if (printStats) {
+        const uint64_t matches = stats.matches;
+        llvm::errs() << "matches: " << matches << "\n"
+                     << "arena bytes: " << stats.arenaBytes << "\n";
+#ifdef REFCNT_COUNT_ALLOCS
+        llvm::errs() << "heap allocations while matching: " << stats.heapAllocs << " ("
+                     << format("%.4f", matches ? (double)stats.heapAllocs / matches : 0.0)
+                     << " per match, operator new only)\n";
+#else
+        llvm::errs() << "heap allocations while matching: not counted"
+                     << " (build with -DREFCNT_COUNT_ALLOCS=ON)\n";
+#endif
+        llvm::errs() << "parse time: " << format("%.3f", stats.tuSeconds - stats.traversalSeconds) << " s"
+                     << (skipFunctionBodies ? " (function bodies skipped)\n" : "\n")
+                     << "traversal time: " << format("%.3f", stats.traversalSeconds) << " s\n";
+        if (fileCache) {
+            llvm::errs() << "file cache: " << file_cache.statHits << " stat hits, "
+                         << file_cache.statMisses << " misses; "
+                         << file_cache.readHits << " read hits, "
+                         << file_cache.readMisses << " misses\n";
+        }
+        if (macroContext) {
+            llvm::errs() << "tracked macro expansions: " << stats.typeMacroExpansions << " type, "
+                         << stats.apiMacroExpansions << " api\n"
+                         << "macro-generated matches: " << stats.macroMatches << "\n";
+        }
+    }
+
+    if (perfCounters) {
+        printPerfCounters(llvm::errs(), stats);
+    }
+
+    if (lexerCompare && engine != Engine::LEXER) {
+        llvm::errs() << "lexer estimate vs. full parse:\n";
+        for (size_t i = 0; i < registry.types.size(); ++i) {
+            const int full = totals.get(i);
+            const int estimate = lexer_estimate.get(i);
+            llvm::errs() << registry.types[i].label << ": " << estimate << " vs. " << full;
+            if (full != 0) {
+                llvm::errs() << format(" (%+.1f%%)", 100.0 * (estimate - full) / full);
+            }
+            llvm::errs() << "\n";
+        }
+    }
+
+    if (!layoutReport.empty()) {
+        std::string err;
+        if (!layout_report.write(layoutReport, std::max(1u, cacheLineSize.getValue()), err)) {
+            llvm::errs() << "Error: " << err << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!writeIncludeIndex.empty()) {
+        std::string err;
+        IncludeIndex previous;
+        if (filepathAccessible(writeIncludeIndex) && previous.load(writeIncludeIndex, err)) {
+            include_graph.merge(previous);
+        }
+        if (!include_graph.write(writeIncludeIndex, err)) {
+            llvm::errs() << "Error: " << err << "\n";
+            return EXIT_FAILURE;
+        }
     }
 
-    llvm::outs() << "atomic_t: " << total_refcnt.atomic_t_cnt << "\n"
-                 << "atomic_long_t: " << total_refcnt.atomic_long_t_cnt << "\n"
-                 << "atomic64_t: " << total_refcnt.atomic64_t_cnt << "\n"
-                 << "refcount_t: " << total_refcnt.refcount_t_cnt << "\n"
-                 << "kref: " << total_refcnt.kref_cnt << "\n";
+    // The totals of a --git-range run only cover the affected TUs, so they
+    // go to stdout alone and the files of the last full run are kept
+    if (!gitRange.empty()) {
+        return EXIT_SUCCESS;
+    }
 
     total_output.open(LOG_DIR + std::string("log.txt"));
     if (!total_output.is_open()) {
@@ -377,11 +4150,21 @@ int main(int argc, const char** argv)
         return EXIT_FAILURE;
     }
 
-    total_output << "atomic_t: " << total_refcnt.atomic_t_cnt << "\n"
-                 << "atomic_long_t: " << total_refcnt.atomic_long_t_cnt << "\n"
-                 << "atomic64_t: " << total_refcnt.atomic64_t_cnt << "\n"
-                 << "refcount_t: " << total_refcnt.refcount_t_cnt << "\n"
-                 << "kref: " << total_refcnt.kref_cnt << "\n";
+    totals.print(total_output);
+    for (const BuildConfig &config : configs) {
+        total_output << "\n[" << config.name << "]\n";
+        config.totals.print(total_output);
+    }
+    if (sampleFraction > 0) {
+        sample_estimate.print(total_output, totals);
+    }
+
+    std::string err;
+    if (!run_totals.aggregates.writeDirectories(LOG_DIR + std::string("directories.txt"), err) ||
+        !run_totals.aggregates.writeStructs(LOG_DIR + std::string("structs.txt"), err)) {
+        llvm::errs() << "Error: " << err << "\n";
+        return EXIT_FAILURE;
+    }
 
     return EXIT_SUCCESS;
 }
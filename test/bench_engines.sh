@@ -0,0 +1,45 @@
+#!/bin/sh
+# Runs refcnt once per engine over the same inputs and compares the results,
+# then reports how far the lexer estimate is from the full parse.
+#
+# usage: LOG_DIR=<refcnt log dir> ./bench_engines.sh <refcnt binary> [refcnt args...]
+#
+# LOG_DIR has to match the LOG_DIR refcnt was built with. It is wiped before
+# each run, because refcnt skips source files whose log already exists.
+
+set -e
+
+if [ -z "$LOG_DIR" ] || [ $# -lt 1 ]; then
+    echo "usage: LOG_DIR=<refcnt log dir> $0 <refcnt binary> [refcnt args...]" >&2
+    exit 1
+fi
+
+REFCNT=$1
+shift
+OUT=$(mktemp -d)
+
+for engine in matcher visitor; do
+    rm -rf "$LOG_DIR"
+    mkdir -p "$LOG_DIR"
+    /usr/bin/time -f "$engine: %e s, %M KB" \
+        "$REFCNT" --engine=$engine --stats "$@" > "$OUT/$engine.txt" 2> "$OUT/$engine.err"
+    cat "$OUT/$engine.err" >&2
+    cp -r "$LOG_DIR" "$OUT/$engine.log"
+done
+
+if diff -r "$OUT/matcher.log" "$OUT/visitor.log" > /dev/null \
+    && diff "$OUT/matcher.txt" "$OUT/visitor.txt" > /dev/null; then
+    echo "outputs identical"
+else
+    echo "outputs differ, see $OUT" >&2
+    exit 1
+fi
+
+rm -rf "$LOG_DIR"
+mkdir -p "$LOG_DIR"
+/usr/bin/time -f "lexer: %e s, %M KB" \
+    "$REFCNT" --engine=lexer "$@" > /dev/null
+rm -rf "$LOG_DIR"
+mkdir -p "$LOG_DIR"
+"$REFCNT" --engine=matcher --lexer-compare "$@" > /dev/null
+rm -rf "$OUT"
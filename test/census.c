@@ -0,0 +1,25 @@
+/* Fixture for check_census.sh: every access to obj.refs, one per line. */
+typedef struct { int counter; } atomic_t;
+
+#define READ_ONCE(x) (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, val) do { *(volatile __typeof__(x) *)&(x) = (val); } while (0)
+
+void atomic_inc(atomic_t *v);
+int atomic_read(const atomic_t *v);
+void consume(atomic_t *v);
+
+struct obj {
+    atomic_t refs;
+};
+
+void use(struct obj *o, atomic_t *saved)
+{
+    atomic_inc(&o->refs);               /* api */
+    (void)atomic_read(&o->refs);        /* api */
+    (void)READ_ONCE(o->refs.counter);   /* read */
+    WRITE_ONCE(o->refs.counter, 1);     /* write */
+    o->refs.counter++;                  /* write */
+    o->refs = *saved;                   /* write */
+    *saved = o->refs;                   /* read */
+    consume(&o->refs);                  /* escape */
+}
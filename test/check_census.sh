@@ -0,0 +1,35 @@
+#!/bin/sh
+# Runs the pair tool's access census over census.c and checks how the
+# accesses to obj.refs are classified, READ_ONCE and WRITE_ONCE included.
+#
+# usage: LOG_DIR=<pair tool log dir> ./check_census.sh <pair tool binary> [args...]
+#
+# LOG_DIR has to match the LOG_DIR the tool was built with. It is wiped
+# before the run, because the tool skips fields whose log already exists.
+
+set -e
+
+if [ -z "$LOG_DIR" ] || [ $# -lt 1 ]; then
+    echo "usage: LOG_DIR=<pair tool log dir> $0 <pair tool binary> [args...]" >&2
+    exit 1
+fi
+
+TOOL=$1
+shift
+SRC=$(cd "$(dirname "$0")" && pwd)/census.c
+OUT=$(mktemp)
+
+# obj.refs is declared on line 12: 2 API calls, 2 reads, 3 writes, 1 escape.
+# Both engines have to agree.
+for engine in matcher visitor; do
+    rm -rf "$LOG_DIR"
+    mkdir -p "$LOG_DIR"
+    "$TOOL" --access-census --engine=$engine "$@" "$SRC" -- > "$OUT"
+    if ! grep -q "census.c:12 2 2 3 1\$" "$OUT"; then
+        echo "unexpected census for census.c:12 with --engine=$engine, see $OUT" >&2
+        exit 1
+    fi
+done
+
+echo "census as expected"
+rm -f "$OUT"
@@ -0,0 +1,76 @@
+#!/bin/sh
+# Runs refcnt over many translation units that include the same header and
+# checks that the header's fields are counted once, whatever the number of
+# TUs, and that peak memory does not grow with the number of TUs.
+#
+# usage: LOG_DIR=<refcnt log dir> ./check_header_totals.sh <refcnt binary> <N> [refcnt args...]
+#
+# LOG_DIR has to match the LOG_DIR refcnt was built with. It is wiped before
+# each run, because refcnt skips source files whose log already exists.
+
+set -e
+
+if [ -z "$LOG_DIR" ] || [ $# -lt 2 ]; then
+    echo "usage: LOG_DIR=<refcnt log dir> $0 <refcnt binary> <N> [refcnt args...]" >&2
+    exit 1
+fi
+
+REFCNT=$1
+N=$2
+shift 2
+OUT=$(mktemp -d)
+
+cat > "$OUT/shared.h" <<EOF
+typedef int atomic_t;
+typedef struct { int counter; } refcount_t;
+struct kref {
+    int refcount;
+};
+struct shared {
+    atomic_t count;
+    refcount_t ref;
+    struct kref kref;
+};
+EOF
+
+i=0
+while [ $i -lt "$N" ]; do
+    cat > "$OUT/tu$i.c" <<EOF
+#include "shared.h"
+int tu$i(struct shared *s) { return s->count; }
+EOF
+    i=$((i + 1))
+done
+
+rm -rf "$LOG_DIR"
+mkdir -p "$LOG_DIR"
+/usr/bin/time -f "%M" -o "$OUT/one.rss" \
+    "$REFCNT" --jobs=1 "$@" "$OUT/tu0.c" -- -I"$OUT" > "$OUT/one.txt"
+
+rm -rf "$LOG_DIR"
+mkdir -p "$LOG_DIR"
+/usr/bin/time -f "%M" -o "$OUT/many.rss" \
+    "$REFCNT" --jobs=1 "$@" "$OUT"/tu*.c -- -I"$OUT" > "$OUT/many.txt"
+
+for type in atomic_t refcount_t kref; do
+    if ! grep -q "^$type: 1\$" "$OUT/one.txt"; then
+        echo "expected one $type field, see $OUT/one.txt" >&2
+        exit 1
+    fi
+done
+if ! diff "$OUT/one.txt" "$OUT/many.txt" > /dev/null; then
+    echo "totals of $N TUs differ from one TU, see $OUT" >&2
+    exit 1
+fi
+
+# Every TU is parsed and released in turn, so N TUs may cost a little more
+# than one (the file cache, the log claims) but not N times as much.
+one=$(cat "$OUT/one.rss")
+many=$(cat "$OUT/many.rss")
+if [ "$many" -gt $((one + one / 4)) ]; then
+    echo "peak memory grew from $one KB for one TU to $many KB for $N, see $OUT" >&2
+    exit 1
+fi
+
+echo "totals identical, peak memory $one KB for one TU, $many KB for $N"
+rm -rf "$OUT"
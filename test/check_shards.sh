@@ -0,0 +1,86 @@
+#!/bin/sh
+# Runs refcnt as N shards plus a merge and checks that the result is
+# byte-identical to a single --jobs=1 run over the same inputs.
+#
+# Only --jobs=1 logs every file through the TU with the lowest ordinal, as
+# merge does. With more threads a header is logged through whichever TU
+# including it finishes first, so such a run is not the reference, and
+# refcnt args must not set --jobs.
+#
+# usage: LOG_DIR=<refcnt log dir> ./check_shards.sh <refcnt binary> <N> [refcnt args...]
+#
+# LOG_DIR has to match the LOG_DIR refcnt was built with. It is wiped before
+# each run, because refcnt skips source files whose log already exists.
+
+set -e
+
+if [ -z "$LOG_DIR" ] || [ $# -lt 2 ]; then
+    echo "usage: LOG_DIR=<refcnt log dir> $0 <refcnt binary> <N> [refcnt args...]" >&2
+    exit 1
+fi
+
+REFCNT=$1
+N=$2
+shift 2
+for arg; do
+    case $arg in
+        --jobs*|-jobs*|-j*)
+            echo "$0: the reference run is --jobs=1, do not pass $arg" >&2
+            exit 1 ;;
+        --)
+            break ;;
+    esac
+done
+OUT=$(mktemp -d)
+
+rm -rf "$LOG_DIR"
+mkdir -p "$LOG_DIR"
+"$REFCNT" --jobs=1 "$@" > "$OUT/single.txt"
+cp -r "$LOG_DIR" "$OUT/single.log"
+
+# The shards run concurrently, like they would on separate hosts
+rm -rf "$LOG_DIR"
+mkdir -p "$LOG_DIR"
+i=0
+pids=
+while [ $i -lt "$N" ]; do
+    "$REFCNT" --shard=$i/$N --result-store="$OUT/shard$i.store" "$@" &
+    pids="$pids $!"
+    i=$((i + 1))
+done
+# A failed shard leaves a partial store, which must not pass the check
+failed=0
+for pid in $pids; do
+    wait "$pid" || failed=1
+done
+if [ $failed -ne 0 ]; then
+    echo "a shard failed, see $OUT" >&2
+    exit 1
+fi
+
+rm -rf "$LOG_DIR"
+mkdir -p "$LOG_DIR"
+# The same refcnt options, so that e.g. --type-config gives the same labels.
+# merge takes no source files or compiler arguments, and options have to be
+# given in their --name=value form.
+compiler=0
+for arg in "$@"; do
+    shift
+    if [ "$arg" = "--" ]; then
+        compiler=1
+    fi
+    case $compiler$arg in
+        0-*) set -- "$@" "$arg" ;;
+    esac
+done
+"$REFCNT" merge "$@" "$OUT"/shard*.store > "$OUT/merged.txt"
+cp -r "$LOG_DIR" "$OUT/merged.log"
+
+if diff -r "$OUT/single.log" "$OUT/merged.log" > /dev/null \
+    && diff "$OUT/single.txt" "$OUT/merged.txt" > /dev/null; then
+    echo "outputs identical"
+else
+    echo "outputs differ, see $OUT" >&2
+    exit 1
+fi
+rm -rf "$OUT"
@@ -5,7 +5,22 @@
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/ASTMatchers/ASTMatchFinder.h"
 #include "clang/ASTMatchers/ASTMatchers.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Lex/Lexer.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/StringSwitch.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Support/raw_ostream.h"
 
 #include <unistd.h>
 #include <stdio.h>
@@ -15,6 +30,16 @@
 #include <iostream>
 #include <iomanip>
 #include <stddef.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 
 #define LOG_DIR "/home/jdoh/test/refcount_pair/log/"
 #define COMPILE_DATABASE "/home/jdoh/test/refcount_pair/compile_commands.json"
@@ -42,6 +67,102 @@ static cl::opt<bool> verbose("verbose",
     cl::cat(refcntCategory)                   // what category this belongs to
 );
 
+static cl::opt<bool> skipFunctionBodies("skip-function-bodies",
+    cl::desc(R"(Do not parse function bodies in the field pass. The call
+pass always parses them, but fields of structs declared
+inside functions are no longer candidates)"),
+    cl::init(false),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<std::string> rulesFile("rules",
+    cl::desc(R"(Filter candidates with the rules in <file> instead of the
+built-in rules)"),
+    cl::value_desc("file"),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<std::string> saveCandidates("save-candidates",
+    cl::desc(R"(Save the collected candidates to <file>)"),
+    cl::value_desc("file"),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<std::string> loadCandidates("load-candidates",
+    cl::desc(R"(Evaluate the rules on candidates saved with
+--save-candidates instead of parsing any source)"),
+    cl::value_desc("file"),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<unsigned> maxDiagnostics("max-diagnostics",
+    cl::desc(R"(Print at most <n> analysis diagnostics, count the rest)"),
+    cl::value_desc("n"),
+    cl::init(20),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<bool> wrapperSummaries("wrapper-summaries",
+    cl::desc(R"(Summarise functions that update a refcount field of their
+parameters and count their call sites as API calls)"),
+    cl::init(false),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<std::string> saveSummaries("save-summaries",
+    cl::desc(R"(Save the wrapper summaries and call site counts of the
+summary pass to <file>)"),
+    cl::value_desc("file"),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<std::string> loadSummaries("load-summaries",
+    cl::desc(R"(Apply wrapper summaries saved with --save-summaries instead
+of running the summary pass)"),
+    cl::value_desc("file"),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<bool> macroContext("macro-context",
+    cl::desc(R"(Attribute API calls expanded from macros to the outermost
+macro and print the macros of every candidate)"),
+    cl::init(false),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<unsigned> jobs("jobs",
+    cl::desc(R"(Number of translation units to analyse in parallel
+(default: 1, 0 for all cores))"),
+    cl::init(1),
+    cl::cat(refcntCategory)
+);
+
+static cl::alias jobsShort("j",
+    cl::desc("Alias for --jobs"),
+    cl::aliasopt(jobs),
+    cl::cat(refcntCategory)
+);
+
+static cl::opt<bool> accessCensusEnabled("access-census",
+    cl::desc(R"(Classify every access to a candidate field as an API call,
+read, write or address escape during the call pass and
+print the counts per field)"),
+    cl::init(false),
+    cl::cat(refcntCategory)
+);
+
+enum class Engine { MATCHER, VISITOR };
+
+static cl::opt<Engine> engine("engine",
+    cl::desc(R"(Select the AST traversal backend)"),
+    cl::values(
+        clEnumValN(Engine::MATCHER, "matcher", "Generic ASTMatchers (default)"),
+        clEnumValN(Engine::VISITOR, "visitor", "Specialised RecursiveASTVisitor")
+    ),
+    cl::init(Engine::MATCHER),
+    cl::cat(refcntCategory)
+);
+
 // ----------------------------------------------------------------------------
 // DEFAULT WARNING SUPPRESSION
 // ----------------------------------------------------------------------------
@@ -59,6 +180,61 @@ class WarningDiagConsumer : public DiagnosticConsumer {
     }
 };
 
+// ----------------------------------------------------------------------------
+// DIAGNOSTICS
+// ----------------------------------------------------------------------------
+
+// Prints at most --max-diagnostics messages and only counts the rest, so a
+// kernel-wide run cannot flood stderr. summarize() reports what was dropped.
+class DiagnosticSink {
+    public:
+    void report(const SourceManager &SM, SourceLocation loc, StringRef msg) {
+        if (printed >= maxDiagnostics) {
+            ++suppressed;
+            return;
+        }
+        ++printed;
+        llvm::errs() << loc.printToString(SM) << ": " << msg << "\n";
+    }
+
+    void summarize() const {
+        if (suppressed != 0) {
+            llvm::errs() << suppressed << " more diagnostics suppressed\n";
+        }
+    }
+
+    private:
+    uint64_t printed = 0;
+    uint64_t suppressed = 0;
+};
+
+// Aggregated counts of value arguments that could not be folded to a
+// constant, by expression kind.
+class UnevaluableArgs {
+    public:
+    void add(StringRef kind) {
+        ++counts[kind];
+        ++total;
+    }
+
+    void summarize() const {
+        if (total == 0) {
+            return;
+        }
+        llvm::errs() << "unevaluable arguments: " << total << "\n";
+        for (const auto &elem : counts) {
+            llvm::errs() << "   " << elem.getKey() << ": " << elem.getValue() << "\n";
+        }
+    }
+
+    private:
+    llvm::StringMap<uint64_t> counts;
+    uint64_t total = 0;
+};
+
+static DiagnosticSink diagnostics;
+static UnevaluableArgs unevaluableArgs;
+
 // ----------------------------------------------------------------------------
 // CALLBACK CLASSES
 // ----------------------------------------------------------------------------
@@ -94,12 +270,319 @@ enum APIArgType {
     VAL_REF   // ex) atomic_add(int i, atomic_t *v);
 };
 
+// What a refcount API call does: the kind of update, where its arguments
+// are, and the delta to use if there is no value argument (times sign).
+struct APICall {
+    APIType apiType;
+    APIArgType argType;
+    long long diff;
+    long long sign;
+};
+
+// Whether `name` is one of the refcount APIs we track. This is the same
+// check as the matchesName() patterns of the call matcher.
+bool isRefcntApiName(StringRef name) {
+    return (name.contains("kref_") || name.contains("atomic_") || name.contains("atomic64_"))
+        && (name.contains("_set") || name.contains("_add") || name.contains("_sub")
+            || name.contains("_inc") || name.contains("_dec") || name.contains("_init")
+            || name.contains("_get") || name.contains("_put"));
+}
+
+// Classifies a tracked API by its name. Returns false for APIs we do not
+// know how to interpret.
+bool classifyAPI(StringRef calleeName, APICall &call) {
+    if (calleeName.contains("init")) {
+        call = { APIType::SET, APIArgType::REF_ONLY, 1, 1 };
+    }
+    else if (calleeName.contains("get") || calleeName.contains("inc")) {
+        call = { APIType::DIFF, APIArgType::REF_ONLY, 1, 1 };
+    }
+    else if (calleeName.contains("put") || calleeName.contains("dec")) {
+        call = { APIType::DIFF, APIArgType::REF_ONLY, 1, -1 };
+    }
+    else if (calleeName.contains("set")) {
+        call = { APIType::SET, APIArgType::REF_VAL, 0, 1 };
+    }
+    else if (calleeName.contains("add_unless")) {
+        call = { APIType::DIFF, APIArgType::REF_VAL, 0, 1 };
+    }
+    else if (calleeName.contains("add")) {
+        call = { APIType::DIFF, APIArgType::VAL_REF, 0, 1 };
+    }
+    else if (calleeName.contains("sub")) {
+        call = { APIType::DIFF, APIArgType::VAL_REF, 0, -1 };
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// Picks the refcount and value arguments of an API call. Returns false if
+// the call does not have enough arguments for its kind.
+bool getAPIArgs(const CallExpr *node, APIArgType argType, const Expr *&refcntArg, const Expr *&valArg) {
+    const unsigned needed = argType == APIArgType::REF_ONLY ? 1 : 2;
+    if (node->getNumArgs() < needed) {
+        return false;
+    }
+
+    switch (argType) {
+    case APIArgType::REF_ONLY:
+        refcntArg = node->getArg(0);
+        valArg = nullptr;
+        break;
+    case APIArgType::REF_VAL:
+        refcntArg = node->getArg(0);
+        valArg = node->getArg(1);
+        break;
+    case APIArgType::VAL_REF:
+        valArg = node->getArg(0);
+        refcntArg = node->getArg(1);
+        break;
+    }
+    return true;
+}
+
+// Returns the member expression an API's refcount argument refers to, e.g.
+// `foo->ref` for `&foo->ref`, or nullptr.
+const MemberExpr *getRefcntMember(const Expr *refcntArg) {
+    refcntArg = refcntArg->IgnoreParenImpCasts();
+    while (const auto *unaryOp = dyn_cast<UnaryOperator>(refcntArg)) {
+        refcntArg = unaryOp->getSubExpr()->IgnoreParenImpCasts();
+    }
+    return dyn_cast<MemberExpr>(refcntArg);
+}
+
 // key = { path, line}
 // value = { { SET, 1 }, { ADD, 1 }, { SUB, 1 }, ... }
 typedef std::pair<std::string, unsigned int> RefcntKey;
 typedef std::pair<APIType, int> RefcntVal;
-typedef std::map<RefcntKey, std::vector<RefcntVal>> RefcntMap;
-static RefcntMap refcntCandidates;
+
+// Candidates are keyed by the file and line of the field declaration.
+RefcntKey getFieldKey(const SourceManager &SM, const FieldDecl *field) {
+    const SourceLocation loc = field->getBeginLoc();
+    return RefcntKey(SM.getFilename(loc).str(), SM.getExpansionLineNumber(loc));
+}
+
+// Features of a candidate's API history, accumulated as calls are collected
+// so that the rules never have to walk the history itself.
+enum RefcntFeature : uint32_t {
+    SET_EXIST     = 1u << 0,    // some SET call
+    INC_EXIST     = 1u << 1,    // some DIFF call with a positive delta
+    DEC_EXIST     = 1u << 2,    // some DIFF call with a negative delta
+    SET_ABOVE_ONE = 1u << 3,    // some SET call with a value > 1
+    INC_ONE       = 1u << 4,    // some DIFF call with delta +1
+    DEC_ONE       = 1u << 5,    // some DIFF call with delta -1
+};
+
+// All refcount candidates, stored column-wise: candidate i is described by
+// flags[i], minDelta[i], maxDelta[i] and maxSet[i], so rule evaluation is a
+// single pass over contiguous arrays. The full per-call history is only
+// kept with --verbose.
+class CandidateStore {
+    public:
+    std::vector<RefcntKey> keys;
+    std::vector<uint32_t> flags;
+    std::vector<uint32_t> calls;
+    std::vector<int32_t> minDelta;      // INT32_MAX if there is no DIFF call
+    std::vector<int32_t> maxDelta;      // INT32_MIN if there is no DIFF call
+    std::vector<int32_t> maxSet;        // INT32_MIN if there is no SET call
+    std::vector<std::vector<RefcntVal>> history;
+    // Calls per outermost macro they were expanded from, with --macro-context
+    std::vector<std::map<std::string, unsigned>> macros;
+
+    // Candidate indices ordered by key, for output.
+    std::map<RefcntKey, unsigned> index;
+
+    size_t size() const {
+        return keys.size();
+    }
+
+    void insert(const RefcntKey &key) {
+        if (!index.insert({key, static_cast<unsigned>(keys.size())}).second) {
+            return;
+        }
+        keys.push_back(key);
+        flags.push_back(0);
+        calls.push_back(0);
+        minDelta.push_back(INT32_MAX);
+        maxDelta.push_back(INT32_MIN);
+        maxSet.push_back(INT32_MIN);
+        history.emplace_back();
+        macros.emplace_back();
+    }
+
+    // Returns the index of the candidate, or -1 if there is none.
+    int find(const RefcntKey &key) const {
+        auto it = index.find(key);
+        return it == index.end() ? -1 : static_cast<int>(it->second);
+    }
+
+    void add(unsigned i, const RefcntVal &val) {
+        switch (val.first) {
+        case APIType::SET:
+            flags[i] |= SET_EXIST | (val.second > 1 ? SET_ABOVE_ONE : 0);
+            maxSet[i] = std::max(maxSet[i], val.second);
+            break;
+        case APIType::DIFF:
+            if (val.second > 0) {
+                flags[i] |= INC_EXIST | (val.second == 1 ? INC_ONE : 0);
+            }
+            else if (val.second < 0) {
+                flags[i] |= DEC_EXIST | (val.second == -1 ? DEC_ONE : 0);
+            }
+            minDelta[i] = std::min(minDelta[i], val.second);
+            maxDelta[i] = std::max(maxDelta[i], val.second);
+            break;
+        default:
+            return;
+        }
+
+        ++calls[i];
+        if (verbose) {
+            history[i].push_back(val);
+        }
+    }
+
+    void addMacro(unsigned i, StringRef macro) {
+        ++macros[i][macro.str()];
+    }
+
+    // Saves the summarised columns (not the history) so that rules can be
+    // re-evaluated later with --load-candidates instead of re-parsing.
+    // One candidate per line: path, line, flags, calls, min/max delta, max set.
+    bool save(StringRef path) const {
+        std::error_code ec;
+        llvm::raw_fd_ostream os(path, ec);
+        if (ec) {
+            return false;
+        }
+        for (size_t i = 0; i < size(); ++i) {
+            os << keys[i].first << "\t" << keys[i].second << "\t" << flags[i] << "\t" << calls[i] << "\t"
+               << minDelta[i] << "\t" << maxDelta[i] << "\t" << maxSet[i] << "\n";
+        }
+        return true;
+    }
+
+    bool load(StringRef path, std::string &err) {
+        auto buffer = llvm::MemoryBuffer::getFile(path);
+        if (!buffer) {
+            err = "cannot read '" + path.str() + "': " + buffer.getError().message();
+            return false;
+        }
+
+        SmallVector<StringRef, 8> fields;
+        for (llvm::line_iterator it(**buffer); !it.is_at_eof(); ++it) {
+            fields.clear();
+            it->split(fields, '\t');
+
+            unsigned line, flag, count;
+            int32_t minD, maxD, maxS;
+            if (fields.size() != 7
+                || fields[1].getAsInteger(10, line) || fields[2].getAsInteger(10, flag)
+                || fields[3].getAsInteger(10, count) || fields[4].getAsInteger(10, minD)
+                || fields[5].getAsInteger(10, maxD) || fields[6].getAsInteger(10, maxS)) {
+                err = path.str() + ":" + std::to_string(it.line_number()) + ": malformed candidate";
+                return false;
+            }
+
+            const RefcntKey key(fields[0].str(), line);
+            insert(key);
+            const unsigned i = index[key];
+            flags[i] = flag;
+            calls[i] = count;
+            minDelta[i] = minD;
+            maxDelta[i] = maxD;
+            maxSet[i] = maxS;
+        }
+        return true;
+    }
+};
+
+static CandidateStore refcntCandidates;
+
+// A call site, identified by the content of the file it is written in and
+// its offset there rather than by path, so a header parsed by many TUs
+// gives the same key in all of them. Calls expanded from the same macro
+// invocation are told apart by their offset in the macro definition.
+struct CallSite {
+    uint64_t content;
+    uint32_t offset;
+    uint32_t spellingOffset;
+
+    bool operator==(const CallSite &other) const {
+        return content == other.content && offset == other.offset &&
+               spellingOffset == other.spellingOffset;
+    }
+};
+
+struct CallSiteHash {
+    size_t operator()(const CallSite &site) const {
+        return llvm::hash_combine(site.content, site.offset, site.spellingOffset);
+    }
+};
+
+// Builds CallSite keys, hashing each file of the TU at most once.
+class CallSiteKeys {
+    public:
+    CallSite get(const SourceManager &SM, SourceLocation loc) {
+        const SourceLocation expansion = SM.getExpansionLoc(loc);
+        const FileID fid = SM.getFileID(expansion);
+        auto inserted = contentHashes.try_emplace(fid, 0);
+        if (inserted.second) {
+            inserted.first->second = llvm::xxHash64(SM.getBufferData(fid));
+        }
+        return { inserted.first->second, SM.getFileOffset(expansion),
+                 SM.getFileOffset(SM.getSpellingLoc(loc)) };
+    }
+
+    void clear() {
+        contentHashes.clear();
+    }
+
+    private:
+    llvm::DenseMap<FileID, uint64_t> contentHashes;
+};
+
+// Set of call sites that may be shared by concurrent passes. It is sharded by
+// hash so inserts from different threads rarely wait on each other.
+class CallSiteSet {
+    public:
+    // Returns true the first time `site` is inserted.
+    bool insert(const CallSite &site) {
+        Shard &shard = shards[CallSiteHash()(site) % NUM_SHARDS];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        return shard.sites.insert(site).second;
+    }
+
+    bool contains(const CallSite &site) {
+        Shard &shard = shards[CallSiteHash()(site) % NUM_SHARDS];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        return shard.sites.count(site) != 0;
+    }
+
+    size_t size() {
+        size_t ret = 0;
+        for (Shard &shard : shards) {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            ret += shard.sites.size();
+        }
+        return ret;
+    }
+
+    private:
+    static constexpr size_t NUM_SHARDS = 64;
+
+    struct Shard {
+        std::mutex lock;
+        std::unordered_set<CallSite, CallSiteHash> sites;
+    };
+    Shard shards[NUM_SHARDS];
+};
+
+// API call sites already added to refcntCandidates. Calls in header inline
+// functions are seen by every TU including the header but count once.
+static CallSiteSet apiCallSites;
 
 class FieldTypeCallback : public MatchFinder::MatchCallback {
     private:
@@ -134,8 +617,11 @@ class FieldTypeCallback : public MatchFinder::MatchCallback {
         if (node == nullptr) {
             return;
         }
+        record(node, *Result.SourceManager);
+    }
 
-        const auto &SM = *Result.SourceManager;
+    // Records a matched field. Shared by the matcher and visitor engines.
+    void record(const FieldDecl *node, const SourceManager &SM) {
         const auto &loc = node->getBeginLoc();
         const auto &srcFile = SM.getFilename(SM.getSpellingLoc(loc)).str();
         std::string logFile;
@@ -159,90 +645,113 @@ class FieldTypeCallback : public MatchFinder::MatchCallback {
             return;
         }
 
-        refcntCandidates.insert({
-            RefcntKey({srcFile, SM.getExpansionLineNumber(loc)}),
-            std::vector<RefcntVal>()
-        });
+        refcntCandidates.insert(RefcntKey({srcFile, SM.getExpansionLineNumber(loc)}));
     }
 };
 
 class ArgTypeCallback : public MatchFinder::MatchCallback {
     private:
-    std::set<std::string> files;
-
-    RefcntMap::iterator getIter(const clang::SourceManager &SM, const Expr *refcntArg) {
-        RefcntMap::iterator ret = refcntCandidates.end();
-
-        refcntArg = refcntArg->IgnoreParenImpCasts();
-        while (const auto *unaryOp = dyn_cast<UnaryOperator>(refcntArg)) {
-            refcntArg = unaryOp->getSubExpr()->IgnoreParenImpCasts();
-        }
+    CallSiteKeys callSites;
 
-        if (const auto *memberExpr = dyn_cast<MemberExpr>(refcntArg)) {
+    int getIndex(const clang::SourceManager &SM, const Expr *refcntArg) {
+        if (const auto *memberExpr = getRefcntMember(refcntArg)) {
             if (const auto *fieldDecl = dyn_cast<FieldDecl>(memberExpr->getMemberDecl())) {
-                SourceLocation loc = fieldDecl->getBeginLoc();
-                ret = refcntCandidates.find({SM.getFilename(loc).str(), SM.getExpansionLineNumber(loc)});
+                return refcntCandidates.find(getFieldKey(SM, fieldDecl));
             }
         }
-        return ret;
+        return -1;
     }
     
-    RefcntVal getVal(const Expr *valArg, APIType apiType, long long diff, long long sign) {
-        if (valArg != nullptr) {
-            valArg = valArg->IgnoreParenImpCasts();
-
-            if (const auto *unaryOp = dyn_cast<UnaryOperator>(valArg)) {
-                if (unaryOp->getOpcode() == UO_Minus) {
-                    sign *= -1;
-                    valArg = unaryOp->getSubExpr()->IgnoreParenImpCasts();
-                }
-            }
+    // Folded values of the API value arguments seen in this TU. Arguments
+    // naming a declaration (enum constants, const variables) are keyed by
+    // the declaration, anything else by the expression, so repeated uses of
+    // the same constant are only folded once.
+    llvm::DenseMap<const void *, std::optional<long long>> evalCache;
+
+    std::optional<long long> evaluate(ASTContext &Context, const Expr *valArg) {
+        valArg = valArg->IgnoreParenImpCasts();
+
+        const void *key = valArg;
+        if (const auto *declRef = dyn_cast<DeclRefExpr>(valArg)) {
+            key = declRef->getDecl();
+        }
 
+        auto inserted = evalCache.try_emplace(key);
+        std::optional<long long> &value = inserted.first->second;
+        if (inserted.second) {
+            Expr::EvalResult result;
             if (const auto *intLit = dyn_cast<IntegerLiteral>(valArg)) {
-                diff = intLit->getValue().getSExtValue();
+                value = intLit->getValue().getSExtValue();
             }
-            else {
-                llvm::errs() << "Argument is not literal!\n";
-                // node->dump();
+            else if (!valArg->isValueDependent() && valArg->EvaluateAsInt(result, Context)) {
+                value = result.Val.getInt().getSExtValue();
+            }
+        }
+
+        // A cached failure is still one more unevaluable use
+        if (!value) {
+            unevaluableArgs.add(valArg->getStmtClassName());
+            diagnostics.report(Context.getSourceManager(), valArg->getExprLoc(),
+                               "argument is not a constant");
+        }
+        return value;
+    }
+
+    RefcntVal getVal(ASTContext &Context, const Expr *valArg, APIType apiType, long long diff, long long sign) {
+        if (valArg != nullptr) {
+            const std::optional<long long> value = evaluate(Context, valArg);
+            if (!value) {
                 return {APIType::ERROR, 0};
             }
+            diff = *value;
         }
         diff *= sign;
         return {apiType, diff};
     }
 
-    bool setKeyVal(const clang::SourceManager &SM, const CallExpr *node, APIType apiType, APIArgType argType, long long diff, long long sign) {
+    // Finds the candidate an API call operates on and the value it applies.
+    // Returns false if either cannot be determined in this TU.
+    bool getKeyVal(ASTContext &Context, const CallExpr *node, const APICall &call,
+                   int &candidate, RefcntVal &val) {
         const Expr *refcntArg, *valArg;
 
-        auto argIt = node->arg_begin();
-
-        switch (argType) {
-        case APIArgType::REF_ONLY:
-            refcntArg = *argIt;
-            valArg = nullptr;
-            break;
-        case APIArgType::REF_VAL:
-            refcntArg = *argIt;
-            valArg = *(++argIt);
-            break;
-        case APIArgType::VAL_REF:
-            valArg = *argIt;
-            refcntArg = *(++argIt);
-            break;
+        if (!getAPIArgs(node, call.argType, refcntArg, valArg)) {
+            return false;
         }
 
-        auto mapIt = getIter(SM, refcntArg);
-        if (mapIt == refcntCandidates.end()) {
-            return true;
+        candidate = getIndex(Context.getSourceManager(), refcntArg);
+        if (candidate < 0) {
+            return false;
         }
 
-        auto val = getVal(valArg, apiType, diff, sign);
-        if (val.first == APIType::ERROR) {
-            return true;
+        val = getVal(Context, valArg, call.apiType, call.diff, call.sign);
+        return val.first != APIType::ERROR;
+    }
+
+    void setKeyVal(ASTContext &Context, const CallExpr *node, int candidate, const RefcntVal &val) {
+        refcntCandidates.add(candidate, val);
+        if (macroContext) {
+            const StringRef macro = getOutermostMacro(Context, node->getCallee()->getExprLoc());
+            if (!macro.empty()) {
+                refcntCandidates.addMacro(candidate, macro);
+            }
         }
+    }
 
-        mapIt->second.push_back(val);
-        return false;
+    // Most refcount APIs are macros in the kernel, and some expand to other
+    // API macros: a call is attributed to the outermost macro whose body
+    // spells the callee. Macros that only take the call as an argument, like
+    // WARN_ON(atomic_dec_and_test(...)), are stepped over.
+    static StringRef getOutermostMacro(ASTContext &Context, SourceLocation loc) {
+        const SourceManager &SM = Context.getSourceManager();
+        StringRef name;
+        while (loc.isMacroID()) {
+            if (!SM.isMacroArgExpansion(loc)) {
+                name = Lexer::getImmediateMacroName(loc, SM, Context.getLangOpts());
+            }
+            loc = SM.getImmediateMacroCallerLoc(loc);
+        }
+        return name;
     }
 
     public:
@@ -251,21 +760,7 @@ class ArgTypeCallback : public MatchFinder::MatchCallback {
     }
 
     virtual void onEndOfTranslationUnit() override {
-        std::string logFileDir;
-        std::ofstream ofs;
-
-        for (auto &elem : files) {
-            logFileDir = elem.substr(0, elem.rfind('/'));
-            if (access(logFileDir.c_str(), F_OK) != 0) {
-                system(("mkdir -p " + logFileDir).c_str());
-            }
-            ofs.open(elem);
-            if (!ofs.is_open()) {
-                llvm::errs() << "Log file '" << elem << "' creation failed!\n";
-                exit(1);
-            }
-            ofs.close();
-        }
+        callSites.clear();
     }
 
     virtual void run(const MatchFinder::MatchResult& Result) override {
@@ -275,103 +770,375 @@ class ArgTypeCallback : public MatchFinder::MatchCallback {
             llvm::errs() << "node not matching argType!\n";
             return;
         }
+        record(node, *Result.Context);
+    }
 
-        const auto &SM = *Result.SourceManager;
+    // Records a matched API call. Shared by the matcher and visitor engines.
+    void record(const CallExpr *node, ASTContext &Context) {
+        const auto &SM = Context.getSourceManager();
         const auto &loc = node->getBeginLoc();
-        const auto &srcFile = SM.getFilename(SM.getSpellingLoc(loc)).str();
-        std::string logFile;
+        const auto &srcFile = SM.getFilename(SM.getSpellingLoc(loc));
 
         if (srcFile.empty()) {
             llvm::outs() << "Path empty!\n";
             return;
         }
-        logFile = LOG_DIR + srcFile;
 
-        if (access(logFile.c_str(), F_OK) == 0) {
+        const CallSite site = callSites.get(SM, loc);
+        if (apiCallSites.contains(site)) {
             return;
         }
 
-        files.insert(logFile);
-
-        const std::string &calleeName = node->getDirectCallee()->getNameAsString();
-        bool err;
-
-        if (calleeName.find("init") != std::string::npos) {
-            err = setKeyVal(SM, node, APIType::SET, APIArgType::REF_ONLY, 1, 1);
-        }
-        else if (calleeName.find("get") != std::string::npos
-            || calleeName.find("inc") != std::string::npos) {
-            err = setKeyVal(SM, node, APIType::DIFF, APIArgType::REF_ONLY, 1, 1);
-        }
-        else if (calleeName.find("put") != std::string::npos
-            || calleeName.find("dec") != std::string::npos) {
-            err = setKeyVal(SM, node, APIType::DIFF, APIArgType::REF_ONLY, 1, -1);
-        }
-        else if (calleeName.find("set") != std::string::npos) {
-            err = setKeyVal(SM, node, APIType::SET, APIArgType::REF_VAL, 0, 1);
-        }
-        else if (calleeName.find("add_unless") != std::string::npos) {
-            err = setKeyVal(SM, node, APIType::DIFF, APIArgType::REF_VAL, 0, 1);
-        }
-        else if (calleeName.find("add") != std::string::npos) {
-            err = setKeyVal(SM, node, APIType::DIFF, APIArgType::VAL_REF, 0, 1);
+        // A call that cannot be evaluated under this TU's config is left for
+        // another TU reaching the same site; the site is only taken once the
+        // call is recorded.
+        APICall call;
+        int candidate;
+        RefcntVal val;
+        if (!classifyAPI(node->getDirectCallee()->getName(), call) ||
+                !getKeyVal(Context, node, call, candidate, val)) {
+            return;
         }
-        else if (calleeName.find("sub") != std::string::npos) {
-            err = setKeyVal(SM, node,APIType::DIFF,  APIArgType::VAL_REF, 0, -1);
+        if (apiCallSites.insert(site)) {
+            setKeyVal(Context, node, candidate, val);
         }
     }
 };
 
-// ----------------------------------------------------------------------------
-// REGISTERING CALLBACKS
-// ----------------------------------------------------------------------------
-
-// The ASTConsumer allows us to dictate:
-//      - which AST nodes we match, and
-//      - how we want to handle those matched nodes
-
-class FieldTypeASTConsumer : public ASTConsumer {
+// How a candidate field is used at one access site.
+enum AccessKind {
+    ACCESS_API,         // argument of an atomic_/refcount_/kref_ function
+    ACCESS_READ,        // any other use of the value, READ_ONCE included
+    ACCESS_WRITE,       // assigned, compound-assigned, incremented or
+                        // decremented, WRITE_ONCE included
+    ACCESS_ESCAPE,      // address taken outside the refcount APIs
+    NUM_ACCESS_KINDS
+};
 
+// Per-candidate access counts, indexed like refcntCandidates. Only filled in
+// with --access-census.
+class AccessCensus {
     public:
-    FieldTypeASTConsumer(clang::Preprocessor& PP) {
-    
-        // Here we add all of the checks that should be run
-        // when the AST is traversed by using Matcher.addMatcher
-
-        // At the moment, there are no checks registered
-
-        // PP.addPPCallbacks(std::make_unique<clang::PPCallbacks>());
-
-        auto *callback = new FieldTypeCallback;
-
-        Matcher.addMatcher(
-            fieldDecl(
-                anyOf(
-                    hasType(typedefNameDecl(hasAnyName(
-                        "atomic_t",
-                        "atomic_long_t",
-                        "atomic64_t",
-                        "refcount_t"
-                    ))),
-                    hasType(recordDecl(hasName("kref")))
-                )
-            ).bind("fieldType"),
-            callback
-        );
+    void add(unsigned i, AccessKind kind) {
+        if (i >= counts.size()) {
+            counts.resize(refcntCandidates.size());
+        }
+        ++counts[i][kind];
     }
 
-    virtual void HandleTranslationUnit(ASTContext& Context) override {
-        Matcher.matchAST(Context);
+    template <typename OStream>
+    void print(OStream &os, const CandidateStore &store) const {
+        os << "Access census (api / read / write / escape):\n";
+        for (auto &elem : store.index) {
+            const unsigned i = elem.second;
+            if (i >= counts.size()) {
+                continue;
+            }
+            const auto &c = counts[i];
+            os << "   " << elem.first.first << ":" << elem.first.second
+               << " " << c[ACCESS_API] << " " << c[ACCESS_READ]
+               << " " << c[ACCESS_WRITE] << " " << c[ACCESS_ESCAPE] << "\n";
+        }
     }
 
     private:
-    MatchFinder Matcher;
+    std::vector<std::array<uint32_t, NUM_ACCESS_KINDS>> counts;
 };
 
-class ArgTypeASTConsumer : public ASTConsumer {
+static AccessCensus accessCensus;
+
+// Access sites already counted. Like apiCallSites, an access in a header is
+// counted once however many TUs include it.
+static CallSiteSet accessSites;
 
+// Classifies the member expressions that name a candidate field. Both engines
+// report nodes in pre-order, so the operator or call using an access is seen
+// before the access itself: they mark their operands, and an access that is
+// still unmarked when it is reached is a plain read.
+//
+// READ_ONCE(x) and WRITE_ONCE(x, v) expand to `*(volatile typeof(x) *)&(x)`,
+// which is a read, or a write on the left of an assignment, and not an
+// escape. The copy of `x` in typeof() has the same source location as the
+// real access, so the accesses of a TU are kept per site and the strongest
+// kind of a site wins: API, write, escape, then read.
+class AccessClassifier {
     public:
-    ArgTypeASTConsumer(clang::Preprocessor& PP) {
+    void onCall(const CallExpr *E, const SourceManager &SM) {
+        const auto *FD = dyn_cast_or_null<FunctionDecl>(E->getCalleeDecl());
+        if (FD == nullptr || !FD->getDeclName().isIdentifier()) {
+            return;
+        }
+        const StringRef name = FD->getName();
+        if (!name.starts_with("atomic") && !name.starts_with("refcount_")
+                && !name.starts_with("kref_")) {
+            return;
+        }
+        for (const Expr *arg : E->arguments()) {
+            if (const auto *member = getRefcntMember(arg)) {
+                mark(member, ACCESS_API, SM);
+            }
+        }
+    }
+
+    void onUnaryOperator(const UnaryOperator *E, const SourceManager &SM) {
+        if (E->getOpcode() == UO_Deref) {
+            if (getOnceAccess(E) != nullptr) {
+                mark(E, ACCESS_READ, SM);
+            }
+        }
+        else if (E->getOpcode() == UO_AddrOf) {
+            mark(E->getSubExpr(), ACCESS_ESCAPE, SM);
+        }
+        else if (E->isIncrementDecrementOp()) {
+            mark(E->getSubExpr(), ACCESS_WRITE, SM);
+        }
+    }
+
+    void onBinaryOperator(const BinaryOperator *E, const SourceManager &SM) {
+        if (E->isAssignmentOp()) {
+            mark(E->getLHS(), ACCESS_WRITE, SM);
+        }
+    }
+
+    void onMemberExpr(const MemberExpr *E, const SourceManager &SM) {
+        const int candidate = getCandidate(E, SM);
+        if (candidate < 0) {
+            return;
+        }
+        auto it = marks.find(E);
+        const AccessKind kind = it == marks.end() ? ACCESS_READ : it->second;
+        auto inserted = sites.try_emplace(callSites.get(SM, E->getMemberLoc()),
+                                          static_cast<unsigned>(candidate), kind);
+        AccessKind &siteKind = inserted.first->second.second;
+        if (getStrength(kind) > getStrength(siteKind)) {
+            siteKind = kind;
+        }
+    }
+
+    // Counts the accesses of the TU, except those already counted by another
+    // TU including the same header.
+    void endTranslationUnit() {
+        for (const auto &site : sites) {
+            if (accessSites.insert(site.first)) {
+                accessCensus.add(site.second.first, site.second.second);
+            }
+        }
+        sites.clear();
+        marks.clear();
+        candidates.clear();
+        callSites.clear();
+    }
+
+    private:
+    llvm::DenseMap<const MemberExpr *, AccessKind> marks;
+    llvm::DenseMap<const FieldDecl *, int> candidates;
+    std::unordered_map<CallSite, std::pair<unsigned, AccessKind>, CallSiteHash> sites;
+    CallSiteKeys callSites;
+
+    static int getStrength(AccessKind kind) {
+        switch (kind) {
+        case ACCESS_API:
+            return 3;
+        case ACCESS_WRITE:
+            return 2;
+        case ACCESS_ESCAPE:
+            return 1;
+        default:
+            return 0;
+        }
+    }
+
+    // Returns `x` if `E` is `*(T *)&(x)`, the shape of READ_ONCE/WRITE_ONCE,
+    // or nullptr.
+    static const Expr *getOnceAccess(const Expr *E) {
+        const auto *deref = dyn_cast<UnaryOperator>(E->IgnoreParenImpCasts());
+        if (deref == nullptr || deref->getOpcode() != UO_Deref) {
+            return nullptr;
+        }
+        const auto *addrOf = dyn_cast<UnaryOperator>(deref->getSubExpr()->IgnoreParenCasts());
+        if (addrOf == nullptr || addrOf->getOpcode() != UO_AddrOf) {
+            return nullptr;
+        }
+        return addrOf->getSubExpr();
+    }
+
+    int getCandidate(const MemberExpr *E, const SourceManager &SM) {
+        const auto *FD = dyn_cast<FieldDecl>(E->getMemberDecl());
+        if (FD == nullptr) {
+            return -1;
+        }
+        auto inserted = candidates.try_emplace(FD, -1);
+        if (inserted.second) {
+            inserted.first->second = refcntCandidates.find(getFieldKey(SM, FD));
+        }
+        return inserted.first->second;
+    }
+
+    // Marks the candidate access `E` refers to, looking through accesses to
+    // members of the field itself, e.g. `obj->cnt` in `obj->cnt.counter`,
+    // and through READ_ONCE/WRITE_ONCE. The first mark wins, so an API
+    // argument stays an API access and `&` in READ_ONCE stays a read.
+    void mark(const Expr *E, AccessKind kind, const SourceManager &SM) {
+        if (const Expr *once = getOnceAccess(E)) {
+            E = once;
+        }
+        E = E->IgnoreParenImpCasts();
+        while (const auto *member = dyn_cast<MemberExpr>(E)) {
+            if (getCandidate(member, SM) >= 0) {
+                marks.try_emplace(member, kind);
+                return;
+            }
+            E = member->getBase()->IgnoreParenImpCasts();
+        }
+    }
+};
+
+// Feeds the classifier from the census matchers of ArgTypeASTConsumer.
+class AccessCensusCallback : public MatchFinder::MatchCallback {
+    public:
+    virtual void onEndOfTranslationUnit() override {
+        classifier.endTranslationUnit();
+    }
+
+    virtual void run(const MatchFinder::MatchResult& Result) override {
+        const auto &SM = *Result.SourceManager;
+        if (const auto *E = Result.Nodes.getNodeAs<CallExpr>("censusCall")) {
+            classifier.onCall(E, SM);
+        }
+        else if (const auto *E = Result.Nodes.getNodeAs<UnaryOperator>("censusUnary")) {
+            classifier.onUnaryOperator(E, SM);
+        }
+        else if (const auto *E = Result.Nodes.getNodeAs<BinaryOperator>("censusAssign")) {
+            classifier.onBinaryOperator(E, SM);
+        }
+        else if (const auto *E = Result.Nodes.getNodeAs<MemberExpr>("censusMember")) {
+            classifier.onMemberExpr(E, SM);
+        }
+    }
+
+    AccessClassifier classifier;
+};
+
+// The visitor engine: a hand-written traversal that reports exactly the
+// nodes the matchers in FieldTypeASTConsumer and ArgTypeASTConsumer would.
+// Declarations are classified once and cached by pointer instead of running
+// the generic matchers on every node.
+class RefcntVisitor : public RecursiveASTVisitor<RefcntVisitor> {
+    public:
+    RefcntVisitor(ASTContext &Context, FieldTypeCallback *fieldCallback, ArgTypeCallback *argCallback,
+                  AccessClassifier *classifier = nullptr)
+    : Context(Context), SM(Context.getSourceManager()),
+      fieldCallback(fieldCallback), argCallback(argCallback), classifier(classifier) {}
+
+    // Walk the same nodes as MatchFinder does by default.
+    bool shouldVisitTemplateInstantiations() const { return true; }
+    bool shouldVisitImplicitCode() const { return true; }
+
+    bool VisitFieldDecl(FieldDecl *D) {
+        if (fieldCallback != nullptr && isTrackedType(D->getType())) {
+            fieldCallback->record(D, SM);
+        }
+        return true;
+    }
+
+    bool VisitCallExpr(CallExpr *E) {
+        if (classifier != nullptr) {
+            classifier->onCall(E, SM);
+        }
+        if (argCallback == nullptr) {
+            return true;
+        }
+        if (const auto *FD = dyn_cast_or_null<FunctionDecl>(E->getCalleeDecl())) {
+            if (isTrackedApi(FD)) {
+                argCallback->record(E, Context);
+            }
+        }
+        return true;
+    }
+
+    bool VisitUnaryOperator(UnaryOperator *E) {
+        if (classifier != nullptr) {
+            classifier->onUnaryOperator(E, SM);
+        }
+        return true;
+    }
+
+    // Compound assignments are visited here too.
+    bool VisitBinaryOperator(BinaryOperator *E) {
+        if (classifier != nullptr) {
+            classifier->onBinaryOperator(E, SM);
+        }
+        return true;
+    }
+
+    bool VisitMemberExpr(MemberExpr *E) {
+        if (classifier != nullptr) {
+            classifier->onMemberExpr(E, SM);
+        }
+        return true;
+    }
+
+    private:
+    ASTContext &Context;
+    const SourceManager &SM;
+    FieldTypeCallback *fieldCallback;
+    ArgTypeCallback *argCallback;
+    AccessClassifier *classifier;
+    llvm::DenseMap<const Decl *, bool> cache;
+
+    // Mirrors hasType(typedefNameDecl(...)) / hasType(recordDecl(...)):
+    // only elaborated sugar is looked through.
+    bool isTrackedType(QualType QT) {
+        const Type *T = QT.getTypePtrOrNull();
+        while (const auto *ET = dyn_cast_or_null<ElaboratedType>(T)) {
+            T = ET->getNamedType().getTypePtrOrNull();
+        }
+
+        const NamedDecl *D = nullptr;
+        bool isTypedef = false;
+        if (const auto *TT = dyn_cast_or_null<TypedefType>(T)) {
+            D = TT->getDecl();
+            isTypedef = true;
+        }
+        else if (const auto *RT = dyn_cast_or_null<RecordType>(T)) {
+            D = RT->getDecl();
+        }
+        else {
+            return false;
+        }
+
+        auto inserted = cache.try_emplace(D, false);
+        if (inserted.second && D->getDeclName().isIdentifier()) {
+            const StringRef name = D->getName();
+            inserted.first->second = isTypedef
+                ? (name == "atomic_t" || name == "atomic_long_t" || name == "atomic64_t" || name == "refcount_t")
+                : name == "kref";
+        }
+        return inserted.first->second;
+    }
+
+    // Mirrors the two matchesName() patterns of the call matcher.
+    bool isTrackedApi(const FunctionDecl *FD) {
+        auto inserted = cache.try_emplace(FD, false);
+        if (inserted.second && FD->getDeclName().isIdentifier()) {
+            inserted.first->second = isRefcntApiName(FD->getName());
+        }
+        return inserted.first->second;
+    }
+};
+
+// ----------------------------------------------------------------------------
+// REGISTERING CALLBACKS
+// ----------------------------------------------------------------------------
+
+// The ASTConsumer allows us to dictate:
+//      - which AST nodes we match, and
+//      - how we want to handle those matched nodes
+
+class FieldTypeASTConsumer : public ASTConsumer {
+
+    public:
+    FieldTypeASTConsumer(clang::Preprocessor& PP) {
     
         // Here we add all of the checks that should be run
         // when the AST is traversed by using Matcher.addMatcher
@@ -380,22 +1147,121 @@ class ArgTypeASTConsumer : public ASTConsumer {
 
         // PP.addPPCallbacks(std::make_unique<clang::PPCallbacks>());
 
-        auto *callback = new ArgTypeCallback;
+        if (engine != Engine::MATCHER) {
+            return;
+        }
+
+        Matcher.addMatcher(
+            fieldDecl(
+                anyOf(
+                    hasType(typedefNameDecl(hasAnyName(
+                        "atomic_t",
+                        "atomic_long_t",
+                        "atomic64_t",
+                        "refcount_t"
+                    ))),
+                    hasType(recordDecl(hasName("kref")))
+                )
+            ).bind("fieldType"),
+            &Callback
+        );
+    }
+
+    virtual void HandleTranslationUnit(ASTContext& Context) override {
+        switch (engine) {
+        case Engine::MATCHER:
+            Matcher.matchAST(Context);
+            break;
+        case Engine::VISITOR:
+            Callback.onStartOfTranslationUnit();
+            RefcntVisitor(Context, &Callback, nullptr)
+                .TraverseDecl(Context.getTranslationUnitDecl());
+            Callback.onEndOfTranslationUnit();
+            break;
+        }
+    }
+
+    private:
+    FieldTypeCallback Callback;
+    MatchFinder Matcher;
+};
+
+class ArgTypeASTConsumer : public ASTConsumer {
+
+    public:
+    ArgTypeASTConsumer(clang::Preprocessor& PP) {
+    
+        // Here we add all of the checks that should be run
+        // when the AST is traversed by using Matcher.addMatcher
+
+        // At the moment, there are no checks registered
+
+        // PP.addPPCallbacks(std::make_unique<clang::PPCallbacks>());
+
+        if (engine != Engine::MATCHER) {
+            return;
+        }
 
         Matcher.addMatcher(
             callExpr(callee(functionDecl(
                 matchesName("(kref_|atomic_|atomic_long_|atomic64_)"),
                 matchesName("(_set|_add|_sub|_inc|_dec|_init|_get|_put)")
             ))).bind("argType"),
-            callback
+            &Callback
+        );
+
+        if (!accessCensusEnabled) {
+            return;
+        }
+        Matcher.addMatcher(
+            callExpr(callee(functionDecl(
+                matchesName("^::(atomic|refcount_|kref_)")
+            ))).bind("censusCall"),
+            &Census
+        );
+        Matcher.addMatcher(
+            unaryOperator(hasAnyOperatorName("*", "&", "++", "--")).bind("censusUnary"),
+            &Census
+        );
+        Matcher.addMatcher(
+            binaryOperator(isAssignmentOperator()).bind("censusAssign"),
+            &Census
+        );
+        Matcher.addMatcher(
+            memberExpr(member(fieldDecl(
+                anyOf(
+                    hasType(typedefNameDecl(hasAnyName(
+                        "atomic_t",
+                        "atomic_long_t",
+                        "atomic64_t",
+                        "refcount_t"
+                    ))),
+                    hasType(recordDecl(hasName("kref")))
+                )
+            ))).bind("censusMember"),
+            &Census
         );
     }
 
     virtual void HandleTranslationUnit(ASTContext& Context) override {
-        Matcher.matchAST(Context);
+        switch (engine) {
+        case Engine::MATCHER:
+            Matcher.matchAST(Context);
+            break;
+        case Engine::VISITOR:
+            Callback.onStartOfTranslationUnit();
+            RefcntVisitor(Context, nullptr, &Callback,
+                          accessCensusEnabled ? &Census.classifier : nullptr)
+                .TraverseDecl(Context.getTranslationUnitDecl());
+            Callback.onEndOfTranslationUnit();
+            Census.onEndOfTranslationUnit();
+            break;
+        }
     }
 
     private:
+    ArgTypeCallback Callback;
+    AccessCensusCallback Census;
     MatchFinder Matcher;
 };
 
@@ -414,6 +1280,10 @@ class FieldTypeFrontEndAction : public ASTFrontendAction {
 
         // llvm::outs() << "File path: " << filePath << "\n";
 
+        // The field pass only looks at declarations. Read by
+        // ASTFrontendAction::ExecuteAction when it starts parsing.
+        CI.getFrontendOpts().SkipFunctionBodies = skipFunctionBodies;
+
         return true;
     }
 
@@ -460,6 +1330,708 @@ class ArgTypeFrontEndAction : public ASTFrontendAction {
     }
 };
 
+// ----------------------------------------------------------------------------
+// WRAPPER SUMMARIES
+// ----------------------------------------------------------------------------
+
+// Kernel code mostly updates refcounts through wrappers such as
+// `foo_get(struct foo *f) { kref_get(&f->ref); }`. The summary pass records,
+// for every function, which fields reachable from its parameters it updates
+// through a tracked API, and which of its parameters it forwards to other
+// functions. Once every TU has been summarised, the summaries are propagated
+// bottom-up over the forwarding edges and each call site of a wrapper is
+// applied to the field it updates.
+
+// Functions are keyed by name if they have external linkage. Kernel code
+// has many `static` functions of the same name, so those are keyed by the
+// file of their first declaration as well: `path:name`. A static inline
+// function in a header still gets the same key in every TU including it.
+std::string getFunctionKey(const SourceManager &SM, const FunctionDecl *FD)
+{
+    if (FD->isExternallyVisible()) {
+        return FD->getName().str();
+    }
+    const SourceLocation loc = SM.getExpansionLoc(FD->getCanonicalDecl()->getLocation());
+    return (SM.getFilename(loc) + ":" + FD->getName()).str();
+}
+
+// `param` of the function updates `field` by `val`.
+struct FieldEffect {
+    unsigned param;
+    RefcntKey field;
+    RefcntVal val;
+
+    bool operator<(const FieldEffect &other) const {
+        return std::tie(param, field, val) < std::tie(other.param, other.field, other.val);
+    }
+};
+
+// The function passes its parameter `callerParam` as argument `calleeParam`
+// of `callee`.
+struct ForwardEdge {
+    std::string callee;
+    unsigned callerParam;
+    unsigned calleeParam;
+};
+
+struct FunctionSummary {
+    std::set<FieldEffect> effects;
+    std::vector<ForwardEdge> forwards;
+};
+
+// Summaries of all functions, shared by the summary pass threads.
+class SummaryStore {
+    public:
+    // Returns true if the caller is the first to summarise the function
+    // `key`. Functions defined in headers are seen by many TUs but only
+    // summarised once.
+    bool claim(StringRef key) {
+        std::lock_guard<std::mutex> guard(lock);
+        return claimed.insert(key).second;
+    }
+
+    // Returns true the first time a call site is seen, so that calls inside
+    // header inline functions are only counted once.
+    bool claimCallSite(const CallSite &site) {
+        return seenCallSites.insert(site);
+    }
+
+    void add(const std::string &name, FunctionSummary summary, const llvm::StringMap<uint64_t> &calls) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!summary.effects.empty() || !summary.forwards.empty()) {
+            functions[name] = std::move(summary);
+        }
+        for (const auto &elem : calls) {
+            callSites[elem.getKey()] += elem.getValue();
+        }
+    }
+
+    void addCalls(const llvm::StringMap<uint64_t> &calls) {
+        add(std::string(), FunctionSummary(), calls);
+    }
+
+    // Folds the effects of forwarded-to functions into their callers, in a
+    // single post-order walk over the forwarding graph. Recursion is cut at
+    // the back edge.
+    void propagate() {
+        std::map<std::string, int> state;       // 0 = new, 1 = on stack, 2 = done
+        for (auto &elem : functions) {
+            visit(elem.first, state);
+        }
+    }
+
+    // Applies every call site of a wrapper to the fields it updates. Returns
+    // the number of API updates added to the candidates.
+    uint64_t apply(CandidateStore &store) const {
+        uint64_t added = 0;
+        for (const auto &elem : callSites) {
+            auto it = functions.find(elem.getKey().str());
+            if (it == functions.end()) {
+                continue;
+            }
+            for (const auto &effect : it->second.effects) {
+                const int candidate = store.find(effect.field);
+                if (candidate < 0) {
+                    continue;
+                }
+                for (uint64_t i = 0; i < elem.getValue(); ++i) {
+                    store.add(candidate, effect.val);
+                }
+                added += elem.getValue();
+            }
+        }
+        return added;
+    }
+
+    // Saves the propagated summaries and the call site counts, so that
+    // --load-summaries can apply them without the summary pass. One entry
+    // per line, fields separated by tabs:
+    //
+    //      F <function>                                    summary follows
+    //      E <param> <path> <line> <API type> <value>      field effect
+    //      W <caller param> <callee param> <callee>        forwarding edge
+    //      C <calls> <function>                            call sites
+    bool save(StringRef path, std::string &err) const {
+        std::error_code ec;
+        llvm::raw_fd_ostream os(path, ec);
+        if (ec) {
+            err = "cannot write '" + path.str() + "': " + ec.message();
+            return false;
+        }
+        for (const auto &elem : functions) {
+            os << "F\t" << elem.first << "\n";
+            for (const auto &effect : elem.second.effects) {
+                os << "E\t" << effect.param << "\t" << effect.field.first << "\t"
+                   << effect.field.second << "\t" << effect.val.first << "\t"
+                   << effect.val.second << "\n";
+            }
+            for (const auto &edge : elem.second.forwards) {
+                os << "W\t" << edge.callerParam << "\t" << edge.calleeParam << "\t"
+                   << edge.callee << "\n";
+            }
+        }
+        for (const auto &elem : callSites) {
+            os << "C\t" << elem.getValue() << "\t" << elem.getKey() << "\n";
+        }
+        return true;
+    }
+
+    bool load(StringRef path, std::string &err) {
+        auto buffer = llvm::MemoryBuffer::getFile(path);
+        if (!buffer) {
+            err = "cannot read '" + path.str() + "': " + buffer.getError().message();
+            return false;
+        }
+
+        FunctionSummary *function = nullptr;
+        SmallVector<StringRef, 8> fields;
+        for (llvm::line_iterator it(**buffer); !it.is_at_eof(); ++it) {
+            fields.clear();
+            it->split(fields, '\t');
+
+            unsigned param, calleeParam, line, type;
+            int value;
+            uint64_t count;
+            if (fields[0] == "F" && fields.size() == 2) {
+                function = &functions[fields[1].str()];
+            }
+            else if (fields[0] == "E" && fields.size() == 6 && function != nullptr
+                     && !fields[1].getAsInteger(10, param) && !fields[3].getAsInteger(10, line)
+                     && !fields[4].getAsInteger(10, type) && type < ERROR
+                     && !fields[5].getAsInteger(10, value)) {
+                function->effects.insert({ param, RefcntKey(fields[2].str(), line),
+                                           RefcntVal(static_cast<APIType>(type), value) });
+            }
+            else if (fields[0] == "W" && fields.size() == 4 && function != nullptr
+                     && !fields[1].getAsInteger(10, param)
+                     && !fields[2].getAsInteger(10, calleeParam)) {
+                function->forwards.push_back({ fields[3].str(), param, calleeParam });
+            }
+            else if (fields[0] == "C" && fields.size() == 3 && !fields[1].getAsInteger(10, count)) {
+                callSites[fields[2]] += count;
+            }
+            else {
+                err = path.str() + ":" + std::to_string(it.line_number()) + ": malformed summary";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t numWrappers() const {
+        size_t ret = 0;
+        for (const auto &elem : functions) {
+            ret += !elem.second.effects.empty();
+        }
+        return ret;
+    }
+
+    private:
+    std::mutex lock;
+    llvm::StringSet<> claimed;
+    CallSiteSet seenCallSites;
+    std::map<std::string, FunctionSummary> functions;
+    llvm::StringMap<uint64_t> callSites;
+
+    void visit(const std::string &name, std::map<std::string, int> &state) {
+        int &s = state[name];
+        if (s != 0) {
+            return;
+        }
+        s = 1;
+
+        auto it = functions.find(name);
+        if (it == functions.end()) {
+            state[name] = 2;
+            return;
+        }
+
+        for (const auto &edge : it->second.forwards) {
+            visit(edge.callee, state);
+            auto callee = functions.find(edge.callee);
+            if (callee == functions.end() || &callee->second == &it->second) {
+                continue;
+            }
+            for (const auto &effect : callee->second.effects) {
+                if (effect.param == edge.calleeParam) {
+                    it->second.effects.insert({ edge.callerParam, effect.field, effect.val });
+                }
+            }
+        }
+        state[name] = 2;
+    }
+};
+
+static SummaryStore summaries;
+
+// Summarises the functions defined in one TU. Call sites of every function
+// are counted as well, since any of them may turn out to be a wrapper.
+class SummaryVisitor : public RecursiveASTVisitor<SummaryVisitor> {
+    public:
+    SummaryVisitor(ASTContext &Context)
+    : Context(Context), SM(Context.getSourceManager()) {}
+
+    bool TraverseFunctionDecl(FunctionDecl *D) {
+        if (!D->doesThisDeclarationHaveABody() || !D->getDeclName().isIdentifier()) {
+            return RecursiveASTVisitor::TraverseFunctionDecl(D);
+        }
+
+        FunctionDecl *outer = current;
+        FunctionSummary summary;
+        const std::string key = getFunctionKey(SM, D);
+        const bool claimed = summaries.claim(key);
+
+        current = claimed ? D : nullptr;
+        std::swap(summary, currentSummary);
+        const bool ret = RecursiveASTVisitor::TraverseFunctionDecl(D);
+        std::swap(summary, currentSummary);
+        current = outer;
+
+        if (claimed) {
+            summaries.add(key, std::move(summary), {});
+        }
+        return ret;
+    }
+
+    bool VisitCallExpr(CallExpr *E) {
+        const FunctionDecl *callee = E->getDirectCallee();
+        if (callee == nullptr || !callee->getDeclName().isIdentifier()) {
+            return true;
+        }
+
+        const StringRef name = callee->getName();
+        if (isRefcntApiName(name)) {
+            if (current != nullptr) {
+                recordEffect(E, name);
+            }
+            return true;
+        }
+
+        if (E->getNumArgs() == 0) {
+            return true;
+        }
+
+        const std::string key = getFunctionKey(SM, callee);
+        if (summaries.claimCallSite(callSites.get(SM, E->getBeginLoc()))) {
+            ++calls[key];
+        }
+
+        if (current != nullptr) {
+            for (unsigned i = 0; i < E->getNumArgs(); ++i) {
+                if (const ParmVarDecl *param = getParam(E->getArg(i))) {
+                    currentSummary.forwards.push_back({ key, param->getFunctionScopeIndex(), i });
+                }
+            }
+        }
+        return true;
+    }
+
+    const llvm::StringMap<uint64_t> &getCalls() const {
+        return calls;
+    }
+
+    private:
+    ASTContext &Context;
+    const SourceManager &SM;
+    FunctionDecl *current = nullptr;
+    FunctionSummary currentSummary;
+    llvm::StringMap<uint64_t> calls;
+    CallSiteKeys callSites;
+
+    // Returns the parameter of the current function that `expr` names or
+    // is a member path of, e.g. `f` for `f->a.ref`.
+    const ParmVarDecl *getParam(const Expr *expr) const {
+        expr = expr->IgnoreParenImpCasts();
+        while (const auto *member = dyn_cast<MemberExpr>(expr)) {
+            expr = member->getBase()->IgnoreParenImpCasts();
+        }
+
+        const auto *declRef = dyn_cast<DeclRefExpr>(expr);
+        if (declRef == nullptr) {
+            return nullptr;
+        }
+        const auto *param = dyn_cast<ParmVarDecl>(declRef->getDecl());
+        if (param == nullptr || param->getDeclContext() != current) {
+            return nullptr;
+        }
+        return param;
+    }
+
+    void recordEffect(const CallExpr *E, StringRef name) {
+        APICall call;
+        const Expr *refcntArg, *valArg;
+        if (!classifyAPI(name, call) || !getAPIArgs(E, call.argType, refcntArg, valArg)) {
+            return;
+        }
+
+        const MemberExpr *member = getRefcntMember(refcntArg);
+        const auto *field = member ? dyn_cast<FieldDecl>(member->getMemberDecl()) : nullptr;
+        const ParmVarDecl *param = member ? getParam(member->getBase()) : nullptr;
+        if (field == nullptr || param == nullptr) {
+            return;
+        }
+
+        long long diff = call.diff;
+        if (valArg != nullptr) {
+            Expr::EvalResult result;
+            if (valArg->isValueDependent() || !valArg->EvaluateAsInt(result, Context)) {
+                return;
+            }
+            diff = result.Val.getInt().getSExtValue();
+        }
+
+        currentSummary.effects.insert({
+            param->getFunctionScopeIndex(),
+            getFieldKey(SM, field),
+            RefcntVal(call.apiType, diff * call.sign)
+        });
+    }
+};
+
+class SummaryASTConsumer : public ASTConsumer {
+
+    public:
+    virtual void HandleTranslationUnit(ASTContext& Context) override {
+        SummaryVisitor visitor(Context);
+        visitor.TraverseDecl(Context.getTranslationUnitDecl());
+        summaries.addCalls(visitor.getCalls());
+    }
+};
+
+class SummaryFrontEndAction : public ASTFrontendAction {
+
+    public:
+    virtual std::unique_ptr<ASTConsumer> CreateASTConsumer(
+            CompilerInstance& CI, StringRef file) override {
+        return std::make_unique<SummaryASTConsumer>();
+    }
+};
+
+// Runs the summary pass on --jobs threads. Each thread takes the next file
+// and runs its own ClangTool on it; the threads only meet in `summaries`.
+// Every tool gets its own physical file system, because the process-wide
+// one changes the working directory of the whole process.
+void runSummaryPass(const CompilationDatabase &compilations, const std::vector<std::string> &files)
+{
+    const auto start = std::chrono::steady_clock::now();
+    const unsigned numThreads = std::max(1u, std::min<unsigned>(
+        jobs ? jobs.getValue() : std::thread::hardware_concurrency(), files.size()));
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+
+    for (unsigned t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&]() {
+            for (size_t i = next++; i < files.size(); i = next++) {
+                ClangTool Tool(compilations, files[i],
+                               std::make_shared<PCHContainerOperations>(),
+                               llvm::vfs::createPhysicalFileSystem());
+                WarningDiagConsumer diagConsumer;
+                Tool.setDiagnosticConsumer(&diagConsumer);
+                Tool.run(newFrontendActionFactory<SummaryFrontEndAction>().get());
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    summaries.propagate();
+    if (verbose) {
+        llvm::errs() << "summary pass: "
+                     << format("%.3f", std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start).count())
+                     << " s, " << summaries.numWrappers() << " wrappers\n";
+    }
+}
+
+// ----------------------------------------------------------------------------
+// RULE ENGINE
+// ----------------------------------------------------------------------------
+
+// Rules are boolean expressions over the features of a candidate:
+//
+//      set, inc, dec               some SET / increment / decrement call
+//      set_above_one               some SET call with a value > 1
+//      inc_one, dec_one            some +1 increment / -1 decrement
+//      calls, max_set,             numeric features, only usable in a
+//      min_delta, max_delta        comparison (==, !=, <, <=, >, >=) with an
+//                                  integer; false if there is no such call
+//
+// combined with !, &&, || and parentheses. A rules file holds one
+// `name: expression` per line ('#' starts a comment) and a candidate is kept
+// if it satisfies all of them. Every rule is compiled to a postfix program
+// whose leaves are evaluated once into a bitset over all candidates, so the
+// rules only cost a few word-wise bitset operations per candidate.
+class RuleSet {
+    public:
+    static constexpr const char *defaultRules =
+        "rule1: set && inc && dec\n"
+        "rule2: !set_above_one\n"
+        "rule3: inc_one && dec_one\n";
+
+    bool parse(StringRef text, std::string &err) {
+        unsigned lineNo = 0;
+        SmallVector<StringRef, 16> lines;
+        text.split(lines, '\n');
+
+        for (StringRef line : lines) {
+            ++lineNo;
+            line = line.split('#').first.trim();
+            if (line.empty()) {
+                continue;
+            }
+
+            auto nameExpr = line.split(':');
+            if (nameExpr.second.empty()) {
+                err = "line " + std::to_string(lineNo) + ": expected 'name: expression'";
+                return false;
+            }
+
+            rules.push_back({ nameExpr.first.trim().str(), {} });
+            cur = nameExpr.second;
+            std::string exprErr;
+            if (!parseOr(rules.back().program, exprErr)) {
+                err = "line " + std::to_string(lineNo) + ": " + exprErr;
+                return false;
+            }
+            skipSpace();
+            if (!cur.empty()) {
+                err = "line " + std::to_string(lineNo) + ": unexpected '" + cur.str() + "'";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Returns the candidates that satisfy every rule and, if report is set,
+    // prints how many candidates each rule keeps on its own.
+    llvm::BitVector evaluate(const CandidateStore &store, raw_ostream *report) const {
+        std::vector<llvm::BitVector> leafBits;
+        for (const auto &leaf : leaves) {
+            leafBits.push_back(evaluateLeaf(leaf, store));
+        }
+
+        llvm::BitVector kept(store.size(), true);
+        for (const auto &rule : rules) {
+            std::vector<llvm::BitVector> stack;
+            for (const auto &op : rule.program) {
+                switch (op.kind) {
+                case Op::LEAF:
+                    stack.push_back(leafBits[op.leaf]);
+                    break;
+                case Op::NOT:
+                    stack.back().flip();
+                    break;
+                case Op::AND:
+                case Op::OR: {
+                    llvm::BitVector rhs = std::move(stack.back());
+                    stack.pop_back();
+                    if (op.kind == Op::AND) {
+                        stack.back() &= rhs;
+                    }
+                    else {
+                        stack.back() |= rhs;
+                    }
+                    break;
+                }
+                }
+            }
+
+            if (report != nullptr) {
+                *report << rule.name << ": " << stack.back().count() << " / " << store.size() << "\n";
+            }
+            kept &= stack.back();
+        }
+        return kept;
+    }
+
+    private:
+    enum Feature {
+        F_SET, F_INC, F_DEC, F_SET_ABOVE_ONE, F_INC_ONE, F_DEC_ONE,
+        F_CALLS, F_MAX_SET, F_MIN_DELTA, F_MAX_DELTA     // numeric
+    };
+    enum Cmp { NONE, EQ, NE, LT, LE, GT, GE };
+
+    struct Leaf {
+        Feature feature;
+        Cmp cmp;
+        long long value;
+    };
+
+    struct Op {
+        enum Kind { LEAF, NOT, AND, OR } kind;
+        unsigned leaf;
+    };
+
+    struct Rule {
+        std::string name;
+        std::vector<Op> program;
+    };
+
+    std::vector<Leaf> leaves;
+    std::vector<Rule> rules;
+    StringRef cur;
+
+    void skipSpace() {
+        cur = cur.ltrim();
+    }
+
+    bool consume(StringRef tok) {
+        skipSpace();
+        return cur.consume_front(tok);
+    }
+
+    bool parseOr(std::vector<Op> &program, std::string &err) {
+        if (!parseAnd(program, err)) {
+            return false;
+        }
+        while (consume("||")) {
+            if (!parseAnd(program, err)) {
+                return false;
+            }
+            program.push_back({ Op::OR, 0 });
+        }
+        return true;
+    }
+
+    bool parseAnd(std::vector<Op> &program, std::string &err) {
+        if (!parseUnary(program, err)) {
+            return false;
+        }
+        while (consume("&&")) {
+            if (!parseUnary(program, err)) {
+                return false;
+            }
+            program.push_back({ Op::AND, 0 });
+        }
+        return true;
+    }
+
+    bool parseUnary(std::vector<Op> &program, std::string &err) {
+        if (consume("!")) {
+            if (!parseUnary(program, err)) {
+                return false;
+            }
+            program.push_back({ Op::NOT, 0 });
+            return true;
+        }
+        if (consume("(")) {
+            if (!parseOr(program, err)) {
+                return false;
+            }
+            if (!consume(")")) {
+                err = "expected ')'";
+                return false;
+            }
+            return true;
+        }
+        return parseAtom(program, err);
+    }
+
+    bool parseAtom(std::vector<Op> &program, std::string &err) {
+        skipSpace();
+        const size_t len = std::min(cur.size(), cur.find_if_not([](char c) {
+            return llvm::isAlnum(c) || c == '_';
+        }));
+        const StringRef name = cur.take_front(len);
+        cur = cur.drop_front(len);
+
+        const std::optional<Feature> feature = llvm::StringSwitch<std::optional<Feature>>(name)
+            .Case("set", F_SET).Case("inc", F_INC).Case("dec", F_DEC)
+            .Case("set_above_one", F_SET_ABOVE_ONE).Case("inc_one", F_INC_ONE).Case("dec_one", F_DEC_ONE)
+            .Case("calls", F_CALLS).Case("max_set", F_MAX_SET)
+            .Case("min_delta", F_MIN_DELTA).Case("max_delta", F_MAX_DELTA)
+            .Default(std::nullopt);
+        if (!feature) {
+            err = name.empty() ? "expected a feature" : "unknown feature '" + name.str() + "'";
+            return false;
+        }
+
+        Leaf leaf = { *feature, NONE, 0 };
+        // Two-character operators first, so that "<=" is not read as "<".
+        static const std::pair<const char *, Cmp> cmps[] = {
+            { "==", EQ }, { "!=", NE }, { "<=", LE }, { ">=", GE }, { "<", LT }, { ">", GT }
+        };
+        for (const auto &cmp : cmps) {
+            if (consume(cmp.first)) {
+                leaf.cmp = cmp.second;
+                break;
+            }
+        }
+
+        const bool numeric = *feature >= F_CALLS;
+        if (numeric != (leaf.cmp != NONE)) {
+            err = "'" + name.str() + (numeric ? "' needs a comparison" : "' cannot be compared");
+            return false;
+        }
+        if (numeric) {
+            skipSpace();
+            if (cur.consumeInteger(10, leaf.value)) {
+                err = "expected an integer after '" + name.str() + "'";
+                return false;
+            }
+        }
+
+        program.push_back({ Op::LEAF, static_cast<unsigned>(leaves.size()) });
+        leaves.push_back(leaf);
+        return true;
+    }
+
+    static bool compare(Cmp cmp, long long lhs, long long rhs) {
+        switch (cmp) {
+        case EQ: return lhs == rhs;
+        case NE: return lhs != rhs;
+        case LT: return lhs < rhs;
+        case LE: return lhs <= rhs;
+        case GT: return lhs > rhs;
+        case GE: return lhs >= rhs;
+        case NONE: break;
+        }
+        return false;
+    }
+
+    static llvm::BitVector evaluateLeaf(const Leaf &leaf, const CandidateStore &store) {
+        const size_t n = store.size();
+        llvm::BitVector bits(n);
+
+        uint32_t flag = 0;
+        switch (leaf.feature) {
+        case F_SET: flag = SET_EXIST; break;
+        case F_INC: flag = INC_EXIST; break;
+        case F_DEC: flag = DEC_EXIST; break;
+        case F_SET_ABOVE_ONE: flag = SET_ABOVE_ONE; break;
+        case F_INC_ONE: flag = INC_ONE; break;
+        case F_DEC_ONE: flag = DEC_ONE; break;
+        default: break;
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            bool value;
+            switch (leaf.feature) {
+            case F_CALLS:
+                value = compare(leaf.cmp, store.calls[i], leaf.value);
+                break;
+            case F_MAX_SET:
+                value = (store.flags[i] & SET_EXIST) && compare(leaf.cmp, store.maxSet[i], leaf.value);
+                break;
+            case F_MIN_DELTA:
+                value = store.minDelta[i] != INT32_MAX && compare(leaf.cmp, store.minDelta[i], leaf.value);
+                break;
+            case F_MAX_DELTA:
+                value = store.maxDelta[i] != INT32_MIN && compare(leaf.cmp, store.maxDelta[i], leaf.value);
+                break;
+            default:
+                value = (store.flags[i] & flag) != 0;
+                break;
+            }
+            if (value) {
+                bits.set(i);
+            }
+        }
+        return bits;
+    }
+};
+
 // ----------------------------------------------------------------------------
 // OUR PROGRAM
 // ----------------------------------------------------------------------------
@@ -472,36 +2044,118 @@ bool filepathAccessible(std::string path)
     return file.is_open();
 }
 
-bool satisfyRules(std::vector<RefcntVal> &vec) {
-    bool setExist = false, incExist = false, decExist = false;  // Rule 1
-    bool setValueIsOne = true;                                  // Rule 2
-    bool incContainsOne = false, decContainsOne = false;        // Rule 3
+// Runs one pass of the analysis and, with --verbose, reports its wall time
+// so that e.g. --skip-function-bodies can be measured on a corpus.
+int runPass(ClangTool &Tool, FrontendActionFactory *factory, const char *name)
+{
+    const auto start = std::chrono::steady_clock::now();
+    const int ret = Tool.run(factory);
+
+    if (verbose) {
+        llvm::errs() << name << " pass: "
+                     << format("%.3f", std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start).count())
+                     << " s\n";
+    }
+    return ret;
+}
 
-    for (auto &elem : vec) {
-        switch (elem.first) {
-        case APIType::SET:
-            setExist = true;
-            if (elem.second > 1) {
-                setValueIsOne = false;
+// Adds the wrapper call sites to the candidates, with summaries from a
+// summary pass over `files` or from --load-summaries. Returns false if the
+// summaries cannot be read or written.
+bool applySummaries(const CompilationDatabase &compilations, const std::vector<std::string> &files)
+{
+    if (!wrapperSummaries && loadSummaries.empty()) {
+        return true;
+    }
+
+    std::string err;
+    if (!loadSummaries.empty()) {
+        if (!summaries.load(loadSummaries, err)) {
+            llvm::errs() << "Error: " << err << "\n";
+            return false;
+        }
+    }
+    else {
+        runSummaryPass(compilations, files);
+    }
+    if (!saveSummaries.empty() && !summaries.save(saveSummaries, err)) {
+        llvm::errs() << "Error: " << err << "\n";
+        return false;
+    }
+    summaries.apply(refcntCandidates);
+    return true;
+}
+
+// Evaluates --rules (or the built-in rules) over the store. Returns false if
+// the rules cannot be read or parsed.
+bool satisfyRules(const CandidateStore &store, llvm::BitVector &keep)
+{
+    std::string text = RuleSet::defaultRules, err;
+
+    if (!rulesFile.empty()) {
+        auto buffer = llvm::MemoryBuffer::getFile(rulesFile);
+        if (!buffer) {
+            llvm::errs() << "Unable to read rules '" << rulesFile << "'\n";
+            return false;
+        }
+        text = (*buffer)->getBuffer().str();
+    }
+
+    RuleSet rules;
+    if (!rules.parse(text, err)) {
+        llvm::errs() << "Invalid rules: " << err << "\n";
+        return false;
+    }
+    keep = rules.evaluate(store, verbose ? &llvm::errs() : nullptr);
+    return true;
+}
+
+// Prints the candidates selected by `keep` (all of them if it is null), in
+// key order. The per-call history is printed with --verbose, otherwise the
+// summarised features are.
+template <typename OStream>
+void printCandidates(OStream &os, const CandidateStore &store, const llvm::BitVector *keep)
+{
+    for (auto &elem : store.index) {
+        const unsigned i = elem.second;
+        if (keep != nullptr && !keep->test(i)) {
+            continue;
+        }
+
+        os << "Path: " << elem.first.first << ", "
+           << "Line: " << elem.first.second << "\n";
+        for (auto &macro : store.macros[i]) {
+            os << "   <MACRO," << macro.first << "," << macro.second << ">\n";
+        }
+
+        if (!verbose) {
+            const uint32_t flags = store.flags[i];
+            os << "   <FLAGS," << flags << "> <CALLS," << store.calls[i] << ">";
+            if (flags & SET_EXIST) {
+                os << " <MAXSET," << store.maxSet[i] << ">";
             }
-            break;
-        case APIType::DIFF:
-            if (elem.second > 0) {
-                incExist = true;
-                if (elem.second == 1) {
-                    incContainsOne = true;
-                }
+            if (flags & (INC_EXIST | DEC_EXIST)) {
+                os << " <DELTA," << store.minDelta[i] << "," << store.maxDelta[i] << ">";
             }
-            else if (elem.second < 0) {
-                decExist = true;
-                if (elem.second == -1) {
-                    decContainsOne = true;
-                }
+            os << "\n";
+            continue;
+        }
+
+        for (auto &el : store.history[i]) {
+            switch (el.first) {
+            case APIType::SET:
+                os << "   <SET,";
+                break;
+            case APIType::DIFF:
+                os << "   <DIFF,";
+                break;
+            default:
+                break;
             }
-            break;
+            os << el.second << ">\n";
         }
     }
-    return setExist && incExist && decExist && setValueIsOne && incContainsOne && decContainsOne;
 }
 
 int main(int argc, const char** argv)
@@ -517,7 +2171,21 @@ int main(int argc, const char** argv)
             llvm::errs() << std::move(err);
             return EXIT_FAILURE;
         }
-    
+
+        // Re-evaluating saved candidates does not need any source at all
+        if (!loadCandidates.empty()) {
+            std::string err;
+            llvm::BitVector keep;
+            if (!refcntCandidates.load(loadCandidates, err)) {
+                llvm::errs() << "Error: " << err << "\n";
+                return EXIT_FAILURE;
+            }
+            if (!satisfyRules(refcntCandidates, keep)) {
+                return EXIT_FAILURE;
+            }
+            printCandidates(llvm::outs(), refcntCandidates, &keep);
+            return EXIT_SUCCESS;
+        }
 
         // Our program is meant to analyse source code, so if we didn't
         // get any filepaths, we print an error message and exit
@@ -537,23 +2205,28 @@ int main(int argc, const char** argv)
 
         ClangTool Tool(OptionsParser->getCompilations(), files);
         Tool.setDiagnosticConsumer(new WarningDiagConsumer);
-        Tool.run(newFrontendActionFactory<FieldTypeFrontEndAction>().get());
-
-        Tool.run(newFrontendActionFactory<ArgTypeFrontEndAction>().get());
-        for (auto &elem : refcntCandidates) {
-            llvm::outs() << "Path: " << elem.first.first << ", "
-                         << "Line: " << elem.first.second << "\n";
-            for (auto &el : elem.second) {
-                switch (el.first) {
-                case APIType::SET:
-                    llvm::outs() << "   <SET,";
-                    break;
-                case APIType::DIFF:
-                    llvm::outs() << "   <DIFF,";
-                    break;
-                }
-                llvm::outs() << el.second << ">\n";
+        runPass(Tool, newFrontendActionFactory<FieldTypeFrontEndAction>().get(), "field");
+
+        runPass(Tool, newFrontendActionFactory<ArgTypeFrontEndAction>().get(), "call");
+        if (!applySummaries(OptionsParser->getCompilations(), files)) {
+            return EXIT_FAILURE;
+        }
+        if (!saveCandidates.empty() && !refcntCandidates.save(saveCandidates)) {
+            llvm::errs() << "Unable to save candidates to '" << saveCandidates << "'\n";
+        }
+
+        if (rulesFile.empty()) {
+            printCandidates(llvm::outs(), refcntCandidates, nullptr);
+        }
+        else {
+            llvm::BitVector keep;
+            if (!satisfyRules(refcntCandidates, keep)) {
+                return EXIT_FAILURE;
             }
+            printCandidates(llvm::outs(), refcntCandidates, &keep);
+        }
+        if (accessCensusEnabled) {
+            accessCensus.print(llvm::outs(), refcntCandidates);
         }
     }
     else {
@@ -570,10 +2243,17 @@ int main(int argc, const char** argv)
         // tool doesn't perform any analysis at all.
         ClangTool Tool(*database, database->getAllFiles());
         Tool.setDiagnosticConsumer(new WarningDiagConsumer);
-        Tool.run(newFrontendActionFactory<FieldTypeFrontEndAction>().get());
+        runPass(Tool, newFrontendActionFactory<FieldTypeFrontEndAction>().get(), "field");
         system("rm -rf " LOG_DIR "*");
-        Tool.run(newFrontendActionFactory<ArgTypeFrontEndAction>().get());
+        runPass(Tool, newFrontendActionFactory<ArgTypeFrontEndAction>().get(), "call");
         system("rm -rf " LOG_DIR "*");
+        if (!applySummaries(*database, database->getAllFiles())) {
+            return EXIT_FAILURE;
+        }
+
+        if (!saveCandidates.empty() && !refcntCandidates.save(saveCandidates)) {
+            llvm::errs() << "Unable to save candidates to '" << saveCandidates << "'\n";
+        }
 
         total_output.open(LOG_DIR "beforelog.txt");
         if (!total_output.is_open()) {
@@ -581,21 +2261,7 @@ int main(int argc, const char** argv)
             return EXIT_FAILURE;
         }
 
-        for (auto &elem : refcntCandidates) {
-            total_output << "Path: " << elem.first.first << ", "
-                         << "Line: " << elem.first.second << "\n";
-            for (auto &el : elem.second) {
-                switch (el.first) {
-                case APIType::SET:
-                    total_output << "   <SET,";
-                    break;
-                case APIType::DIFF:
-                    total_output << "   <DIFF,";
-                    break;
-                }
-                total_output << el.second << ">\n";
-            }
-        }
+        printCandidates(total_output, refcntCandidates, nullptr);
 
         total_output.close();
         total_output.open(LOG_DIR "afterlog.txt");
@@ -604,31 +2270,24 @@ int main(int argc, const char** argv)
             return EXIT_FAILURE;
         }
 
-        for (auto it = refcntCandidates.begin(); it != refcntCandidates.end(); ) {
-            if (!satisfyRules(it->second)) {
-                it = refcntCandidates.erase(it);
-            }
-            else {
-                ++it;
-            }
+        llvm::BitVector keep;
+        if (!satisfyRules(refcntCandidates, keep)) {
+            return EXIT_FAILURE;
         }
+        printCandidates(total_output, refcntCandidates, &keep);
+        total_output.close();
 
-        for (auto &elem : refcntCandidates) {
-            total_output << "Path: " << elem.first.first << ", "
-                         << "Line: " << elem.first.second << "\n";
-            for (auto &el : elem.second) {
-                switch (el.first) {
-                case APIType::SET:
-                    total_output << "   <SET,";
-                    break;
-                case APIType::DIFF:
-                    total_output << "   <DIFF,";
-                    break;
-                }
-                total_output << el.second << ">\n";
+        if (accessCensusEnabled) {
+            total_output.open(LOG_DIR "census.txt");
+            if (!total_output.is_open()) {
+                llvm::errs() << "output file open failed!\n";
+                return EXIT_FAILURE;
             }
+            accessCensus.print(total_output, refcntCandidates);
+            total_output.close();
         }
-        total_output.close();
     }
+    diagnostics.summarize();
+    unevaluableArgs.summarize();
     return EXIT_SUCCESS;
 }